@@ -3,23 +3,24 @@
  * A sample client to test file-based map-reduce framework
  */
 #include "mr_framework.h"
+#include "mr_pipeline.h"
 #include "debug.h"
 #include <vector>
 #include <utility>
 #include <fstream>
+#include <iostream>
+#include <exception>
 
 constexpr char input_delimiter = '\n';
 
 /**
  * @brief Transformer object for first map stage
  */
-struct transformer_t : map_t
+struct transformer_t : emit_map_t
 {
-    citem_t operator()(std::ifstream &ins) override
+    void operator()(std::string_view record, emitter_t &emit) override
     {
-        std::string s;
-        std::getline(ins, s);
-        return citem_t{s, 0};
+        emit(record, 0);
     }
 };
 
@@ -58,23 +59,24 @@ struct accumulator_t : reduce_t
 };
 
 /**
- * @brief Accumulator object for final reduce stage
+ * @brief Accumulator object for final reduce stage: gets the maximum of all the values
+ * of every key, outputs the maximum of them in the end
  */
-struct maximizer_t : reduce_t
+struct maximizer_t : group_reduce_t
 {
-    citem_t operator()(std::ifstream &_in) override final
+    void operator()([[maybe_unused]] const citem_t::key_type &key, kv_values_t<citem_t> values,
+                    [[maybe_unused]] kv_output_t<citem_t> &out) override final
     {
-        citem_t it;
-        _in >> it;
-        if (!it.key.size())
-            return result;
-        result.val = std::max(result.val, it.val);
-        return result;
+        for (int val : values)
+            maxval = std::max(maxval, val);
     }
-    maximizer_t()
+    void finish(kv_output_t<citem_t> &out) override final
     {
-        result = {"", 0};
+        out("", maxval);
     }
+
+private:
+    int maxval = 0;
 };
 
 int main(int argc, char **argv)
@@ -84,31 +86,86 @@ int main(int argc, char **argv)
     if (!get_params(argc, argv, mnum, rnum))
         return 0;
 
-    // Init the framework
-    mr_init();
+    // A failed split or read stops the job with an error, rather than a wrong result
+    try
+    {
+        // Containers left by every stage of the job, in order; a pipeline counts as one stage
+        std::vector<std::size_t> stage_outputs;
+        if (mr_config.pipeline)
+            stage_outputs = {static_cast<std::size_t>(rnum), 1, 1};
+        else
+            stage_outputs = {static_cast<std::size_t>(mnum), static_cast<std::size_t>(rnum),
+                             static_cast<std::size_t>(rnum), 1, 1};
 
-    // Find mnum + 1 boundaries of the input file, named "c-1"
-    auto boundaries = mr_split_file(input_delimiter, mnum);
+        // Init the framework, or go on with the stages a previous run has finished
+        int done = 0;
+        if (mr_config.resume)
+        {
+            if (!mr_resume())
+                std::cout << "Nothing to resume, starting over\n";
+            else if (mr_manifest.stage < 1 || mr_manifest.stage > static_cast<int>(stage_outputs.size()) ||
+                     mr_manifest.containers.size() != stage_outputs[mr_manifest.stage - 1])
+                std::cout << "The saved run does not match the options, starting over\n";
+            else
+                done = mr_manifest.stage;
+        }
+        if (!done)
+            mr_init();
+        int stage = 0;
+        auto pending = [&]
+        { return ++stage > done; };
 
-    // Produce mnum files ("c0 - c<mnum-1>") from the input file
-    {
-        mr_stage_t<transformer_t> map(mnum, boundaries, &mr_sort);
-    }
+        // Fewer mappers than cores: every mapper sorts its buffer on the pool
+        basic_sortf_t *sortf = (mnum < static_cast<int>(mr_pool().size())) ? &mr_parallel_sort : &mr_sort;
 
-    // Shuffle results into rnum files ("c0 - c<rnum-1>")
-    mr_shuffle(mnum, rnum);
+        if (mr_config.pipeline)
+        {
+            // The same three stages, overlapped
+            if (pending())
+            {
+                auto boundaries = mr_split_file(input_delimiter, mnum);
+                mr_pipeline_t<transformer_t, accumulator_t> map_reduce_1(mnum, rnum, boundaries, sortf);
+            }
+        }
+        else
+        {
+            // Produce mnum files from the input file, listed in mr_manifest
+            if (pending())
+            {
+                // Find mnum + 1 boundaries of the input file, named "c-1"
+                auto boundaries = mr_split_file(input_delimiter, mnum);
+                mr_stage_t<transformer_t> map(mnum, boundaries, sortf);
+            }
 
-    // Find max prefix length for every file
-    {
-        mr_stage_t<accumulator_t> reduce_1(rnum, {});
-    }
+            // Shuffle results into rnum files
+            if (pending())
+                mr_shuffle(mnum, rnum);
 
-    // Shuffle results into a single file "c0"
-    mr_shuffle(rnum, 1);
+            // Find max prefix length for every file
+            if (pending())
+            {
+                mr_stage_t<accumulator_t> reduce_1(rnum, {});
+            }
+        }
 
-    // Find maximum prefix in a single file and output it into "c0"
+        // Shuffle results into a single file
+        if (pending())
+            mr_shuffle(rnum, 1);
+
+        // Find maximum prefix in a single file and output it into "c0"
+        if (pending())
+        {
+            mr_stage_t<maximizer_t> reduce_2(1, {});
+        }
+
+        // Intermediate containers are binary, the result is text
+        mr_export_text(1);
+        mr_report_metrics();
+    }
+    catch (std::exception &e)
     {
-        mr_stage_t<maximizer_t> reduce_2(1, {});
+        std::cerr << e.what() << '\n';
+        return 1;
     }
     return 0;
 }
@@ -0,0 +1,513 @@
+/**
+ * @brief mr_aio.cpp
+ * realization of asynchronous I/O engines and stream buffers
+ */
+#include "mr_aio.h"
+#include "mr_framework.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef MR_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+void aio_engine_t::wait(aio_request_t &req)
+{
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&req]
+            { return req.done; });
+}
+
+void aio_engine_t::complete(aio_request_t &req)
+{
+    {
+        std::lock_guard lock(mutex);
+        req.done = true;
+    }
+    cv.notify_all();
+}
+
+/**
+ * @brief Engine of a few threads, which do requests by blocking pread/pwrite
+ */
+class thread_aio_engine_t : public aio_engine_t
+{
+public:
+    explicit thread_aio_engine_t(unsigned nthreads)
+    {
+        for (unsigned i = 0; i < nthreads; ++i)
+            threads.emplace_back(&thread_aio_engine_t::loop, this);
+    }
+
+    ~thread_aio_engine_t() override
+    {
+        {
+            std::lock_guard lock(queue_mutex);
+            stop = true;
+        }
+        queue_cv.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+
+    const char *name() const override { return "threads"; }
+
+    void submit(aio_request_t &req) override
+    {
+        {
+            std::lock_guard lock(queue_mutex);
+            queue.push_back(&req);
+        }
+        queue_cv.notify_one();
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<aio_request_t *> queue;
+    bool stop = false;
+
+    void loop()
+    {
+        while (true)
+        {
+            aio_request_t *req;
+            {
+                std::unique_lock lock(queue_mutex);
+                queue_cv.wait(lock, [this]
+                                { return stop || queue.size(); });
+                if (queue.empty())
+                    return;
+                req = queue.front();
+                queue.pop_front();
+            }
+            while (req->transferred < req->len)
+            {
+                auto buf = req->buf + req->transferred;
+                auto len = req->len - req->transferred;
+                auto off = req->offset + static_cast<off_t>(req->transferred);
+                auto n = req->write ? ::pwrite(req->fd, buf, len, off) : ::pread(req->fd, buf, len, off);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    req->error = -errno;
+                if (n <= 0)
+                    break;
+                req->transferred += n;
+            }
+            complete(*req);
+        }
+    }
+};
+
+#ifdef MR_HAVE_IO_URING
+/**
+ * @brief Engine of an io_uring, driven by raw system calls: submitters fill
+ * the submission ring under a mutex, a reaper thread waits for completions;
+ * requests in flight are limited by the size of the completion ring
+ */
+class uring_aio_engine_t : public aio_engine_t
+{
+public:
+    explicit uring_aio_engine_t(unsigned entries)
+    {
+        io_uring_params p{};
+        ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (ring_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+
+        auto sq = static_cast<char *>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        auto cq = static_cast<char *>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        max_in_flight = p.cq_entries;
+
+        reaper = std::thread(&uring_aio_engine_t::reap_loop, this);
+    }
+
+    ~uring_aio_engine_t() override
+    {
+        // A request with no user data stops the reaper
+        if (reaper.joinable())
+        {
+            if (!push(nullptr))
+            {
+                // The reaper can't be stopped, it keeps the ring, which is left mapped
+                reaper.detach();
+                return;
+            }
+            reaper.join();
+        }
+        ::munmap(sqes, sqes_size);
+        if (cq_ptr != sq_ptr)
+            ::munmap(cq_ptr, cq_size);
+        ::munmap(sq_ptr, sq_size);
+        ::close(ring_fd);
+    }
+
+    const char *name() const override { return "io_uring"; }
+
+    void submit(aio_request_t &req) override
+    {
+        {
+            std::unique_lock lock(flight_mutex);
+            flight_cv.wait(lock, [this]
+                           { return in_flight < max_in_flight; });
+            in_flight++;
+        }
+        push(&req);
+    }
+
+private:
+    int ring_fd = -1;
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    std::size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes;
+    std::mutex sq_mutex;
+    std::mutex flight_mutex;
+    std::condition_variable flight_cv;
+    unsigned in_flight = 0;
+    unsigned max_in_flight;
+    std::thread reaper;
+
+    void *map(std::size_t size, off_t offset)
+    {
+        auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        if (p == MAP_FAILED)
+        {
+            auto err = errno;
+            ::close(ring_fd);
+            throw std::system_error(err, std::generic_category(), "io_uring mmap");
+        }
+        return p;
+    }
+
+    // Put the rest of a request (or a stop marker) into the submission ring and enter it;
+    // if it can't be entered, a request is done with the error
+    bool push(aio_request_t *req)
+    {
+        std::lock_guard lock(sq_mutex);
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & sq_mask;
+        auto &sqe = sqes[idx];
+        std::memset(&sqe, 0, sizeof(sqe));
+        if (req)
+        {
+            sqe.opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = req->fd;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(req->buf + req->transferred);
+            sqe.len = static_cast<unsigned>(req->len - req->transferred);
+            sqe.off = req->offset + req->transferred;
+        }
+        else
+            sqe.opcode = IORING_OP_NOP;
+        sqe.user_data = reinterpret_cast<std::uintptr_t>(req);
+        sq_array[idx] = idx;
+        std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+        while (::syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0)
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                auto err = errno;
+                std::cerr << "io_uring_enter: " << std::strerror(err) << '\n';
+                // An entry the kernel has consumed completes by the reaper, an unconsumed one is taken back
+                if (std::atomic_ref(*sq_head).load(std::memory_order_acquire) == tail + 1)
+                    return true;
+                std::atomic_ref(*sq_tail).store(tail, std::memory_order_release);
+                if (req)
+                {
+                    req->error = -err;
+                    finish(*req);
+                }
+                return false;
+            }
+        return true;
+    }
+
+    void reap_loop()
+    {
+        while (true)
+        {
+            unsigned head = *cq_head;
+            unsigned tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+            if (head == tail)
+            {
+                ::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                continue;
+            }
+            bool stop = false;
+            std::vector<aio_request_t *> unfinished;
+            for (; head != tail; ++head)
+            {
+                auto &cqe = cqes[head & cq_mask];
+                auto req = reinterpret_cast<aio_request_t *>(cqe.user_data);
+                if (!req)
+                {
+                    stop = true;
+                    continue;
+                }
+                if (cqe.res > 0)
+                    req->transferred += cqe.res;
+                else if (cqe.res < 0)
+                    req->error = cqe.res;
+                if (cqe.res > 0 && req->transferred < req->len)
+                    unfinished.push_back(req);
+                else
+                    finish(*req);
+            }
+            std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+            // A short read or write is continued, it stays in flight
+            for (auto req : unfinished)
+                push(req);
+            if (stop)
+                return;
+        }
+    }
+
+    void finish(aio_request_t &req)
+    {
+        complete(req);
+        {
+            std::lock_guard lock(flight_mutex);
+            in_flight--;
+        }
+        flight_cv.notify_one();
+    }
+};
+#endif
+
+std::unique_ptr<aio_engine_t> make_aio_engine(aio_mode_t mode)
+{
+    constexpr unsigned io_threads = 4;
+#ifdef MR_HAVE_IO_URING
+    if (mode == aio_mode_t::uring)
+    {
+        try
+        {
+            return std::make_unique<uring_aio_engine_t>(256);
+        }
+        catch (std::system_error &e)
+        {
+            std::cerr << e.what() << ", I/O threads are used instead\n";
+        }
+    }
+#else
+    (void)mode;
+#endif
+    return std::make_unique<thread_aio_engine_t>(io_threads);
+}
+
+aio_engine_t &mr_aio()
+{
+    static auto engine = make_aio_engine(mr_config.aio_mode);
+    return *engine;
+}
+
+std::unique_ptr<std::istream> open_merge_input(const std::string &path, std::size_t buffer_size,
+                                               std::streamoff start)
+{
+    if (mr_config.aio_mode != aio_mode_t::off && !mr_memory().find(path))
+    {
+        auto codec = container_compression(path);
+        if (codec == compression_t::none)
+            return std::make_unique<aio_ifstream_t>(mr_aio(), path, buffer_size, start);
+        // Reads of a compressed container start at the frame of the position
+        off_t offset = start ? decompress_buf_t::file_offset(start) : compressed_header_size;
+        auto in = std::make_unique<aio_ifstream_t>(mr_aio(), path, buffer_size, offset);
+        in->decompress(codec, offset, start & (max_block_size - 1));
+        return in;
+    }
+    auto in = std::make_unique<container_ifstream_t>(path, buffer_size);
+    if (start)
+        in->seekg(start);
+    return in;
+}
+
+void check_merge_input(const std::istream &in, const std::string &path)
+{
+    if (in.bad())
+        throw std::system_error(EIO, std::generic_category(), "merge input " + path);
+}
+
+std::unique_ptr<std::ostream> open_merge_output(const std::string &path)
+{
+    if (mr_config.aio_mode != aio_mode_t::off && mr_config.backend == backend_t::file)
+    {
+        auto out = std::make_unique<aio_ofstream_t>(mr_aio(), path, mr_config.io_buffer_size);
+        if (mr_config.compression != compression_t::none)
+            out->compress(mr_config.compression, mr_config.compress_block_size);
+        return out;
+    }
+    return std::make_unique<container_ofstream_t>(path);
+}
+
+aio_readbuf_t::aio_readbuf_t(aio_engine_t &_engine, const std::string &path, std::size_t _size, off_t start)
+    : engine(_engine), size(_size), memory(std::make_unique_for_overwrite<char[]>(2 * _size)),
+      start_offset(start), next_offset(start)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    read_ahead(0);
+    read_ahead(1);
+}
+
+aio_readbuf_t::~aio_readbuf_t()
+{
+    for (auto &r : reqs)
+        engine.wait(r);
+    ::close(fd);
+}
+
+void aio_readbuf_t::read_ahead(int half)
+{
+    auto &r = reqs[half];
+    r = aio_request_t{fd, memory.get() + half * size, size, next_offset};
+    r.done = false;
+    next_offset += size;
+    engine.submit(r);
+}
+
+aio_readbuf_t::int_type aio_readbuf_t::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (exhausted)
+        return traits_type::eof();
+    if (eback())
+    {
+        // A short half is the last one
+        if (at_end)
+        {
+            exhausted = true;
+            return traits_type::eof();
+        }
+        // The consumed half reads the part after the next one
+        read_ahead(cur);
+        cur ^= 1;
+    }
+    auto &r = reqs[cur];
+    engine.wait(r);
+    // The stream gets badbit, the rest of the file is not taken for its end
+    if (r.error)
+        throw std::system_error(-r.error, std::generic_category(), "read");
+    if (r.transferred < r.len)
+        at_end = true;
+    setg(r.buf, r.buf, r.buf + r.transferred);
+    if (!r.transferred)
+    {
+        exhausted = true;
+        return traits_type::eof();
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
+aio_readbuf_t::pos_type aio_readbuf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (off != 0 || dir != std::ios::cur || !(which & std::ios::in))
+        return pos_type(off_type(-1));
+    if (!eback())
+        return pos_type(start_offset);
+    return pos_type(reqs[cur].offset + (gptr() - eback()));
+}
+
+aio_writebuf_t::aio_writebuf_t(aio_engine_t &_engine, const std::string &path, std::size_t _size)
+    : engine(_engine), size(_size), memory(std::make_unique_for_overwrite<char[]>(2 * _size))
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    setp(memory.get(), memory.get() + size);
+}
+
+aio_writebuf_t::~aio_writebuf_t()
+{
+    sync();
+    ::close(fd);
+}
+
+// Submit the filled half, wait for the write of the other one and fill it
+bool aio_writebuf_t::flip()
+{
+    std::size_t n = pptr() - pbase();
+    if (n)
+    {
+        auto &r = reqs[cur];
+        r = aio_request_t{fd, pbase(), n, offset, true};
+        r.done = false;
+        offset += n;
+        engine.submit(r);
+        cur ^= 1;
+    }
+    wait_write(cur);
+    setp(memory.get() + cur * size, memory.get() + (cur + 1) * size);
+    return !failed;
+}
+
+void aio_writebuf_t::wait_write(int half)
+{
+    auto &r = reqs[half];
+    engine.wait(r);
+    if (r.error || r.transferred < r.len)
+    {
+        if (!failed)
+            std::cerr << "write: " << std::strerror(r.error ? -r.error : ENOSPC) << '\n';
+        failed = true;
+    }
+    r = aio_request_t{};
+}
+
+aio_writebuf_t::int_type aio_writebuf_t::overflow(int_type c)
+{
+    if (!flip())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int aio_writebuf_t::sync()
+{
+    // The filled half is written out, then both writes are waited for
+    flip();
+    wait_write(cur ^ 1);
+    return failed ? -1 : 0;
+}
+
+aio_writebuf_t::pos_type aio_writebuf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (off != 0 || dir != std::ios::cur || !(which & std::ios::out))
+        return pos_type(off_type(-1));
+    return pos_type(offset + (pptr() - pbase()));
+}
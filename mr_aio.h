@@ -0,0 +1,191 @@
+/**
+ * @brief mr_aio.h
+ * asynchronous reads and writes of container files for merges:
+ * io_uring on Linux, if the kernel allows it, or threads doing blocking I/O
+ */
+#pragma once
+
+#include "mr_compress.h"
+#include "mr_record.h"
+#include <condition_variable>
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * @brief Realizations of asynchronous I/O
+ * off - merges read and write containers by blocking buffered streams
+ * threads - requests are done by a few I/O threads with pread/pwrite
+ * uring - requests are submitted to an io_uring, threads if it can't be set up
+ */
+enum class aio_mode_t
+{
+    off,
+    threads,
+    uring
+};
+
+/**
+ * @brief A read or write of a file range; it is in flight from submit
+ * till its engine marks it done
+ */
+struct aio_request_t
+{
+    int fd = -1;
+    char *buf = nullptr;
+    std::size_t len = 0;
+    off_t offset = 0;
+    bool write = false;
+    // Bytes transferred; fewer than len only at the end of file or on error
+    std::size_t transferred = 0;
+    // Negative errno, if the request failed
+    int error = 0;
+    bool done = true;
+};
+
+/**
+ * @brief Engine of asynchronous file I/O; requests complete in any order,
+ * a short read or write is continued by the engine itself
+ */
+class aio_engine_t
+{
+public:
+    virtual ~aio_engine_t() = default;
+    virtual const char *name() const = 0;
+
+    // Start a request; it must not be touched until wait() for it returns
+    virtual void submit(aio_request_t &req) = 0;
+
+    // Block until the request is done
+    void wait(aio_request_t &req);
+
+protected:
+    // Mark a request done and wake up its waiter
+    void complete(aio_request_t &req);
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// An engine of the mode; an io_uring one falls back to threads, if it can't be set up
+std::unique_ptr<aio_engine_t> make_aio_engine(aio_mode_t mode);
+
+/**
+ * @brief Stream buffer reading a file by two halves: one is consumed,
+ * while the engine reads the next part of the file into the other
+ */
+class aio_readbuf_t : public std::streambuf
+{
+public:
+    aio_readbuf_t(aio_engine_t &_engine, const std::string &path, std::size_t _size, off_t start = 0);
+    ~aio_readbuf_t() override;
+    aio_readbuf_t(const aio_readbuf_t &) = delete;
+    aio_readbuf_t &operator=(const aio_readbuf_t &) = delete;
+
+protected:
+    int_type underflow() override;
+    // Only tellg() is supported: the position is the file offset of the next byte
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+
+private:
+    aio_engine_t &engine;
+    int fd;
+    std::size_t size;
+    std::unique_ptr<char[]> memory;
+    aio_request_t reqs[2];
+    int cur = 0;
+    off_t start_offset;
+    off_t next_offset;
+    bool at_end = false;    // a read has reached the end of file, no more reads are needed
+    bool exhausted = false; // all the file is consumed
+
+    void read_ahead(int half);
+};
+
+/**
+ * @brief Stream buffer writing a file by two halves: one is filled,
+ * while the engine writes the other out
+ */
+class aio_writebuf_t : public std::streambuf
+{
+public:
+    aio_writebuf_t(aio_engine_t &_engine, const std::string &path, std::size_t _size);
+    ~aio_writebuf_t() override;
+    aio_writebuf_t(const aio_writebuf_t &) = delete;
+    aio_writebuf_t &operator=(const aio_writebuf_t &) = delete;
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+    // Only tellp() is supported: the position is the number of bytes written
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+
+private:
+    aio_engine_t &engine;
+    int fd;
+    std::size_t size;
+    std::unique_ptr<char[]> memory;
+    aio_request_t reqs[2];
+    int cur = 0;
+    off_t offset = 0; // of the half being filled
+    bool failed = false;
+
+    bool flip();
+    void wait_write(int half);
+};
+
+/**
+ * @brief Input stream of a container, read ahead asynchronously
+ */
+class aio_ifstream_t : public std::istream
+{
+public:
+    aio_ifstream_t(aio_engine_t &engine, const std::string &path, std::size_t buffer_size, off_t start = 0)
+        : std::istream(nullptr), buf(engine, path, buffer_size, start)
+    {
+        rdbuf(&buf);
+    }
+
+    // Decompress the container, which is read from a frame at start; skip - bytes of its block to skip
+    void decompress(compression_t codec, off_t start, std::size_t skip)
+    {
+        decompressor = std::make_unique<decompress_buf_t>(&buf, codec, start, skip);
+        rdbuf(decompressor.get());
+    }
+
+private:
+    aio_readbuf_t buf;
+    std::unique_ptr<decompress_buf_t> decompressor;
+};
+
+/**
+ * @brief Output stream of a container, written behind asynchronously
+ */
+class aio_ofstream_t : public std::ostream
+{
+public:
+    aio_ofstream_t(aio_engine_t &engine, const std::string &path, std::size_t buffer_size)
+        : std::ostream(nullptr), buf(engine, path, buffer_size)
+    {
+        rdbuf(&buf);
+    }
+
+    // Compress the container from now on; the last block is written out on destruction
+    void compress(compression_t codec, std::size_t block_size)
+    {
+        auto header = compressed_header(codec);
+        buf.sputn(header.data(), header.size());
+        compressor = std::make_unique<compress_buf_t>(&buf, codec, block_size, header.size());
+        rdbuf(compressor.get());
+    }
+
+private:
+    aio_writebuf_t buf;
+    std::unique_ptr<compress_buf_t> compressor;
+};
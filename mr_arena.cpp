@@ -0,0 +1,69 @@
+/**
+ * @brief mr_arena.cpp
+ * realization of the arena of keys
+ */
+#include "mr_arena.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <new>
+
+// Time of an allocation, if the arena is timed
+struct alloc_timer_t
+{
+    long *ns;
+    std::chrono::steady_clock::time_point start;
+    explicit alloc_timer_t(long *_ns) : ns(_ns), start(_ns ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}) {}
+    ~alloc_timer_t()
+    {
+        if (ns)
+            *ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+void key_arena_t::release()
+{
+    blocks.clear();
+    cur = end = nullptr;
+    next_chunk = min_chunk;
+    held = 0;
+}
+
+void *key_arena_t::do_allocate(std::size_t bytes, std::size_t align)
+{
+    alloc_timer_t timer(timed ? &ns : nullptr);
+    nallocations++;
+    if (!bump)
+        return ::operator new(bytes, std::align_val_t(align));
+    auto p = reinterpret_cast<char *>((reinterpret_cast<std::uintptr_t>(cur) + align - 1) & ~(align - 1));
+    if (cur && p + bytes <= end)
+    {
+        cur = p + bytes;
+        return p;
+    }
+    return allocate_slow(bytes, align);
+}
+
+void *key_arena_t::allocate_slow(std::size_t bytes, std::size_t align)
+{
+    std::size_t size = std::max(next_chunk, bytes + align);
+    next_chunk = std::min(next_chunk * 2, max_chunk);
+    blocks.push_back(std::make_unique_for_overwrite<char[]>(size));
+    nchunks++;
+    held += size;
+    peak = std::max(peak, held);
+    cur = blocks.back().get();
+    end = cur + size;
+    auto p = reinterpret_cast<char *>((reinterpret_cast<std::uintptr_t>(cur) + align - 1) & ~(align - 1));
+    cur = p + bytes;
+    return p;
+}
+
+void key_arena_t::do_deallocate(void *p, std::size_t bytes, std::size_t align)
+{
+    if (!bump)
+    {
+        alloc_timer_t timer(timed ? &ns : nullptr);
+        ::operator delete(p, bytes, std::align_val_t(align));
+    }
+}
@@ -0,0 +1,75 @@
+/**
+ * @brief mr_arena.h
+ * arena of string keys: a worker keeps the keys of its buffers in chunks,
+ * which are freed in bulk, instead of a heap allocation per key
+ */
+#pragma once
+
+#include "mr_record.h"
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+/**
+ * @brief Memory resource of keys: a bump allocator over chunks, which grow from min_chunk
+ * to max_chunk; deallocation is a no-op, memory is freed by release() or on destruction.
+ * With bump off it passes allocations to the heap, so the two can be compared:
+ * both count allocations and, if timed, the time spent in them
+ */
+class key_arena_t : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t min_chunk = 64 << 10;
+    static constexpr std::size_t max_chunk = 4 << 20;
+
+    explicit key_arena_t(bool _bump = true, bool _timed = false) : bump(_bump), timed(_timed) {}
+    ~key_arena_t() override { release(); }
+    key_arena_t(const key_arena_t &) = delete;
+    key_arena_t &operator=(const key_arena_t &) = delete;
+
+    // Free all the chunks; keys allocated here must be gone
+    void release();
+
+    long allocations() const { return nallocations; }
+    long chunks() const { return nchunks; }
+    long allocated_ns() const { return ns; }
+    // Peak bytes of chunks
+    long peak_bytes() const { return peak; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override;
+    void do_deallocate(void *p, std::size_t bytes, std::size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+    bool bump;
+    bool timed;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cur = nullptr;
+    char *end = nullptr;
+    std::size_t next_chunk = min_chunk;
+    long held = 0;
+    long peak = 0;
+    long nallocations = 0;
+    long nchunks = 0;
+    long ns = 0;
+
+    void *allocate_slow(std::size_t bytes, std::size_t align);
+};
+
+// String keys, which may live in an arena
+template <typename K>
+concept arena_key = string_key<K> && std::same_as<typename K::allocator_type, std::pmr::polymorphic_allocator<char>>;
+
+/**
+ * @brief A copy of the item with its key in the arena, if the key may live there
+ */
+template <typename Item>
+Item arena_copy(const Item &it, std::pmr::memory_resource *arena)
+{
+    if constexpr (arena_key<typename Item::key_type>)
+        return Item{typename Item::key_type(it.key, arena), it.val};
+    else
+        return it;
+}
@@ -0,0 +1,514 @@
+/**
+ * @brief mr_bench.cpp
+ * Benchmarks for the map-reduce framework parts;
+ * every result is printed as one JSON object per line
+ * The use is: mr_bench [records] [pool threads] [merge|splits|sort|keys|aio|phases] [generator flags]
+ */
+#include "mr_framework.h"
+#include "mr_gen.h"
+#include "mr_merge.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief In-memory sorted run, readable by merge engines
+ */
+struct vector_reader_t
+{
+    const std::vector<citem_t> *items;
+    std::size_t pos = 0;
+};
+
+bool read_item(vector_reader_t &r, citem_t &it)
+{
+    if (r.pos >= r.items->size())
+        return false;
+    it = (*r.items)[r.pos++];
+    return true;
+}
+
+// Random e-mail-like key, as in the sample input
+citem_t::key_type random_key(std::mt19937_64 &gen)
+{
+    static const char *domains[] = {"@mail.com", "@example.com", "@yahoo.com", "@gmail.com"};
+    std::uniform_int_distribution<int> len(5, 10), letter('a', 'z'), dom(0, 3);
+    citem_t::key_type s;
+    for (int i = len(gen); i > 0; --i)
+        s += static_cast<char>(letter(gen));
+    return s + domains[dom(gen)];
+}
+
+// Split 'total' random records into 'mnum' sorted runs
+std::vector<std::vector<citem_t>> make_runs(long total, int mnum, std::mt19937_64 &gen)
+{
+    std::vector<std::vector<citem_t>> runs(mnum);
+    for (long i = 0; i < total; ++i)
+        runs[i % mnum].push_back(citem_t{random_key(gen), 0});
+    for (auto &r : runs)
+        std::sort(r.begin(), r.end(), key_less_t{});
+    return runs;
+}
+
+std::vector<vector_reader_t> make_readers(const std::vector<std::vector<citem_t>> &runs)
+{
+    std::vector<vector_reader_t> readers;
+    for (auto &r : runs)
+        readers.push_back(vector_reader_t{&r});
+    return readers;
+}
+
+// The linear-scan merge, as mr_shuffle did it before the merge engine
+long linear_merge(std::vector<vector_reader_t> &readers)
+{
+    std::vector<std::pair<citem_t, vector_reader_t *>> workset;
+    for (auto &r : readers)
+    {
+        citem_t it;
+        if (read_item(r, it))
+            workset.push_back({it, &r});
+    }
+    long count = 0;
+    while (workset.size())
+    {
+        auto cur = std::min_element(workset.begin(), workset.end(),
+                                    [](const auto &a, const auto &b)
+                                    { return a.first.key < b.first.key; });
+        ++count;
+        auto p = cur->second;
+        workset.erase(cur);
+        citem_t it;
+        if (read_item(*p, it))
+            workset.push_back({it, p});
+    }
+    return count;
+}
+
+long heap_merge(std::vector<vector_reader_t> &readers)
+{
+    std::vector<vector_reader_t *> inputs;
+    for (auto &r : readers)
+        inputs.push_back(&r);
+    kway_merge_t<vector_reader_t> merge(inputs);
+    long count = 0;
+    for (; !merge.empty(); merge.pop())
+        ++count;
+    return count;
+}
+
+template <typename F>
+void report(const char *bench, const char *variant, int mnum, F &&f)
+{
+    auto start = std::chrono::steady_clock::now();
+    long records = f();
+    std::chrono::duration<double> sec = std::chrono::steady_clock::now() - start;
+    std::cout << "{\"bench\":\"" << bench << "\",\"variant\":\"" << variant
+              << "\",\"mnum\":" << mnum << ",\"records\":" << records
+              << ",\"sec\":" << sec.count()
+              << ",\"records_per_sec\":" << (sec.count() > 0 ? records / sec.count() : 0)
+              << "}\n";
+}
+
+// Merge throughput versus number of input runs
+void bench_merge(long total)
+{
+    std::mt19937_64 gen(1);
+    for (int mnum = 2; mnum <= 1024; mnum *= 2)
+    {
+        auto runs = make_runs(total, mnum, gen);
+        auto readers = make_readers(runs);
+        report("merge", "heap", mnum, [&]
+               { return heap_merge(readers); });
+        readers = make_readers(runs);
+        report("merge", "linear", mnum, [&]
+               { return linear_merge(readers); });
+    }
+}
+
+/**
+ * @brief Map object with skewed cost: records, which start with '!', are expensive
+ */
+struct skewed_map_t : emit_map_t
+{
+    void operator()(std::string_view record, emitter_t &emit) override
+    {
+        unsigned long h = 0;
+        int rounds = (record.size() && record[0] == '!') ? 2000 : 1;
+        for (int r = 0; r < rounds; ++r)
+            for (char c : record)
+                h = h * 31 + c;
+        emit(record, static_cast<int>(h & 0xff));
+    }
+};
+
+// Wall time of a stage and busy/cpu time of its slowest and average thread
+void report_stage(const char *bench, const char *variant, int mnum, const stage_metrics_t &s)
+{
+    double max_busy = 0, sum_busy = 0, max_cpu = 0, sum_cpu = 0;
+    for (auto &t : s.threads)
+    {
+        max_busy = std::max(max_busy, t.busy_sec);
+        sum_busy += t.busy_sec;
+        max_cpu = std::max(max_cpu, t.cpu_sec);
+        sum_cpu += t.cpu_sec;
+    }
+    double n = std::max<double>(1, s.threads.size());
+    long records_in = 0, records_out = 0, bytes_read = 0, bytes_written = 0;
+    for (auto &t : s.threads)
+    {
+        records_in += t.records_in;
+        records_out += t.records_out;
+        bytes_read += t.bytes_read;
+        bytes_written += t.bytes_written;
+    }
+    std::cout << "{\"bench\":\"" << bench << "\",\"variant\":\"" << variant
+              << "\",\"mnum\":" << mnum << ",\"sec\":" << s.wall_sec
+              << ",\"max_busy_sec\":" << max_busy << ",\"mean_busy_sec\":" << sum_busy / n
+              << ",\"max_cpu_sec\":" << max_cpu << ",\"mean_cpu_sec\":" << sum_cpu / n
+              << ",\"records_in\":" << records_in << ",\"records_out\":" << records_out
+              << ",\"bytes_read\":" << bytes_read << ",\"bytes_written\":" << bytes_written
+              << ",\"process_peak_rss_kb\":" << s.process_peak_rss_kb
+              << "}\n";
+}
+
+// Map stage on an input with expensive records gathered at its start:
+// a split per mapper versus small splits pulled from a queue
+void bench_splits(long total)
+{
+    namespace fs = std::filesystem;
+    auto dir = fs::temp_directory_path() / "mr_bench";
+    fs::create_directories(dir);
+    auto cwd = fs::current_path();
+    fs::current_path(dir);
+    mr_init();
+    {
+        std::mt19937_64 gen(2);
+        std::ofstream out(workfile_path(input_file_id));
+        for (long i = 0; i < total; ++i)
+            out << (i < total / 8 ? "!" : "") << random_key(gen) << '\n';
+    }
+    long fsize = file_bytes(workfile_path(input_file_id));
+
+    const int mnum = 8;
+    for (auto variant : {"static", "dynamic"})
+    {
+        mr_config.split_size = (variant == std::string("static")) ? 0 : std::max(1L, fsize / (mnum * 16));
+        mr_init();
+        auto boundaries = mr_split_file('\n', mnum);
+        {
+            mr_stage_t<skewed_map_t> map(mnum, boundaries);
+        }
+        report_stage("splits", variant, mnum, mr_metrics.last_stage());
+    }
+    mr_init();
+    fs::current_path(cwd);
+}
+
+// Sort of a map buffer of e-mail-like keys: std::sort versus radix sort by key prefixes,
+// on one thread and by sample sort on the pool
+void bench_sort(long total)
+{
+    std::mt19937_64 gen(3);
+    std::vector<citem_t> items;
+    items.reserve(total);
+    for (long i = 0; i < total; ++i)
+        items.push_back(citem_t{random_key(gen), 1});
+
+    struct variant_t
+    {
+        const char *name;
+        sort_mode_t mode;
+        basic_sortf_t *sortf;
+    };
+    const variant_t variants[] = {{"comparison", sort_mode_t::comparison, &mr_sort},
+                                  {"prefix", sort_mode_t::prefix, &mr_sort},
+                                  {"parallel_comparison", sort_mode_t::comparison, &mr_parallel_sort},
+                                  {"parallel_prefix", sort_mode_t::prefix, &mr_parallel_sort}};
+    std::vector<citem_t> first;
+    for (auto &v : variants)
+    {
+        auto buffer = items;
+        mr_config.sort_mode = v.mode;
+        int threads = (v.sortf == &mr_sort) ? 1 : static_cast<int>(mr_pool().size());
+        report("sort", v.name, threads, [&]
+               {
+                   (*v.sortf)(buffer);
+                   return static_cast<long>(buffer.size()); });
+        if (first.empty())
+            first = std::move(buffer);
+        else if (!std::equal(first.begin(), first.end(), buffer.begin(),
+                             [](const citem_t &a, const citem_t &b)
+                             { return a.key == b.key; }))
+            std::cerr << "sort: the order of " << v.name << " differs\n";
+    }
+}
+
+// Keys of a sort buffer in the heap versus in an arena: the buffer is filled, sorted and freed
+void bench_keys(long total)
+{
+    std::mt19937_64 gen(5);
+    std::vector<citem_t> items;
+    items.reserve(total);
+    for (long i = 0; i < total; ++i)
+        items.push_back(citem_t{random_key(gen), 1});
+
+    for (bool bump : {false, true})
+    {
+        key_arena_t arena(bump);
+        report("keys", bump ? "arena" : "heap", 1, [&]
+               {
+                   {
+                       std::vector<citem_t> buffer;
+                       buffer.reserve(items.size());
+                       for (auto &it : items)
+                           buffer.push_back(arena_copy(it, &arena));
+                       mr_sort(buffer);
+                   }
+                   arena.release();
+                   return total; });
+        std::cout << "{\"bench\":\"keys\",\"variant\":\"" << (bump ? "arena" : "heap")
+                  << "\",\"allocations\":" << arena.allocations() << ",\"chunks\":" << arena.chunks() << "}\n";
+    }
+}
+
+// Drop a file from the page cache, so it is read from the disk again
+void evict_from_cache(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+// Merge of sorted runs on disk into one container: by blocking buffered streams
+// versus read-ahead and write-behind of aio engines; the runs are out of the page cache
+void bench_aio(long total)
+{
+    namespace fs = std::filesystem;
+    auto dir = fs::temp_directory_path() / "mr_bench";
+    fs::create_directories(dir);
+    std::mt19937_64 gen(4);
+    for (int nruns : {16, 128, 1024})
+    {
+        std::vector<std::string> paths;
+        {
+            auto runs = make_runs(total, nruns, gen);
+            for (int i = 0; i < nruns; ++i)
+            {
+                paths.push_back(dir / ("run" + std::to_string(i)));
+                container_ofstream_t out(paths.back());
+                for (auto &it : runs[i])
+                    out << it;
+            }
+        }
+        auto out_path = dir / "merged";
+        for (auto mode : {aio_mode_t::off, aio_mode_t::threads, aio_mode_t::uring})
+        {
+            std::unique_ptr<aio_engine_t> engine;
+            if (mode != aio_mode_t::off)
+                engine = make_aio_engine(mode);
+            for (auto &path : paths)
+                evict_from_cache(path);
+            auto buffer_size = merge_buffer_size(nruns);
+            report("aio_merge", engine ? engine->name() : "blocking", nruns, [&]
+                   {
+                       std::vector<std::unique_ptr<std::istream>> files;
+                       std::vector<std::istream *> inputs;
+                       for (auto &path : paths)
+                       {
+                           if (engine)
+                               files.push_back(std::make_unique<aio_ifstream_t>(*engine, path, buffer_size));
+                           else
+                               files.push_back(std::make_unique<container_ifstream_t>(path, buffer_size));
+                           inputs.push_back(files.back().get());
+                       }
+                       std::unique_ptr<std::ostream> out;
+                       if (engine)
+                           out = std::make_unique<aio_ofstream_t>(*engine, out_path, mr_config.io_buffer_size);
+                       else
+                           out = std::make_unique<container_ofstream_t>(out_path);
+                       long count = 0;
+                       for (kway_merge_t<std::istream> merge(inputs); !merge.empty(); merge.pop(), ++count)
+                           write_item(*out, merge.top());
+                       return count; });
+        }
+        for (auto &path : paths)
+            fs::remove(path);
+        fs::remove(out_path);
+    }
+}
+
+/**
+ * @brief Map object of the phases benchmark: every key is counted once
+ */
+struct count_map_t : emit_map_t
+{
+    void operator()(std::string_view record, emitter_t &emit) override
+    {
+        emit(record, 1);
+    }
+};
+
+/**
+ * @brief Reduce object of the phases benchmark: the count of every key
+ */
+struct count_reduce_t : group_reduce_t
+{
+    static inline std::atomic<long> total{0};
+
+    void operator()(const citem_t::key_type &key, kv_values_t<citem_t> values, kv_output_t<citem_t> &out) override
+    {
+        int count = 0;
+        for (int val : values)
+            count += val;
+        total += count;
+        out(key, count);
+    }
+};
+
+// Split, map, sort, shuffle and reduce of a word count on a generated input, phase by phase,
+// then all of them end to end
+void bench_phases(const gen_config_t &gen)
+{
+    namespace fs = std::filesystem;
+    auto dir = fs::temp_directory_path() / "mr_bench";
+    fs::create_directories(dir);
+    auto cwd = fs::current_path();
+    fs::current_path(dir);
+    mr_init();
+
+    gen_stats_t stats;
+    report("phases", "generate", 1, [&]
+           {
+               std::ofstream out(workfile_path(input_file_id), std::ios::binary);
+               stats = generate_input(gen, out);
+               return stats.records; });
+    std::cout << "{\"bench\":\"phases\",\"variant\":\"input\",\"input\":";
+    write_gen_json(std::cout, gen, stats);
+    std::cout << "}\n";
+
+    const int mnum = std::max<int>(2, mr_pool().size()), rnum = mnum;
+    auto run = [&](bool report_phases)
+    {
+        std::vector<long> boundaries;
+        auto split = [&]
+        {
+            boundaries = mr_split_file('\n', mnum);
+            return stats.records;
+        };
+        if (report_phases)
+            report("phases", "split", mnum, split);
+        else
+            split();
+        {
+            mr_stage_t<count_map_t> map(mnum, boundaries);
+        }
+        if (report_phases)
+            report_stage("phases", "map", mnum, mr_metrics.last_stage());
+        mr_shuffle(mnum, rnum);
+        if (report_phases)
+            report_stage("phases", "shuffle", rnum, mr_metrics.last_stage());
+        count_reduce_t::total = 0;
+        {
+            mr_stage_t<count_reduce_t> reduce(rnum, {});
+        }
+        if (report_phases)
+            report_stage("phases", "reduce", rnum, mr_metrics.last_stage());
+        if (count_reduce_t::total != stats.records)
+            std::cerr << "phases: " << count_reduce_t::total << " keys counted of " << stats.records << '\n';
+        return stats.records;
+    };
+    run(true);
+
+    // The sort of a map buffer of the input keys alone, by one thread and on the pool
+    {
+        std::vector<citem_t> items;
+        items.reserve(gen.records);
+        key_generator_t keys(gen);
+        for (long i = 0; i < gen.records; ++i)
+            items.push_back(citem_t{keys(), 1});
+        for (auto sortf : {&mr_sort, static_cast<basic_sortf_t *>(&mr_parallel_sort)})
+        {
+            auto buffer = items;
+            bool parallel = (sortf != &mr_sort);
+            report("phases", parallel ? "parallel_sort" : "sort", parallel ? static_cast<int>(mr_pool().size()) : 1, [&]
+                   {
+                       (*sortf)(buffer);
+                       return static_cast<long>(buffer.size()); });
+        }
+    }
+
+    report("phases", "end_to_end", mnum, [&]
+           {
+               mr_init();
+               return run(false); });
+    mr_init();
+    fs::current_path(cwd);
+}
+
+static void usage()
+{
+    std::cerr << "The use is: mr_bench [records] [pool threads] [merge|splits|sort|keys|aio|phases] [generator flags]\n"
+              << "  records and pool threads are positive numbers, 65536 records and hardware concurrency by default\n"
+              << "  generator flags of the phases benchmark:\n"
+              << gen_flags_usage();
+}
+
+// A positive number, the whole argument
+static bool parse_count(std::string_view arg, long &n)
+{
+    auto [p, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), n);
+    return ec == std::errc() && p == arg.data() + arg.size() && n > 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const std::string benches[] = {"merge", "splits", "sort", "keys", "aio", "phases"};
+    long total = 1L << 16, threads = 0;
+    if ((argc > 1 && !parse_count(argv[1], total)) || (argc > 2 && !parse_count(argv[2], threads)) ||
+        (argc > 3 && std::find(std::begin(benches), std::end(benches), argv[3]) == std::end(benches)))
+    {
+        usage();
+        return 1;
+    }
+    if (threads)
+        mr_config.threads = threads;
+    std::string only = argc > 3 ? argv[3] : "";
+    gen_config_t gen;
+    gen.records = total;
+    gen.keys = total / 8;
+    gen.skew = 1;
+    for (int i = 4; i < argc; ++i)
+        if (!parse_gen_flag(argv[i], gen))
+        {
+            std::cerr << "Unknown generator flag " << argv[i] << '\n';
+            usage();
+            return 1;
+        }
+    if (only.empty() || only == "merge")
+        bench_merge(total);
+    if (only.empty() || only == "splits")
+        bench_splits(total);
+    if (only.empty() || only == "sort")
+        bench_sort(total);
+    if (only.empty() || only == "keys")
+        bench_keys(total);
+    if (only.empty() || only == "aio")
+        bench_aio(total);
+    if (only.empty() || only == "phases")
+        bench_phases(gen);
+    return 0;
+}
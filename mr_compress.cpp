@@ -0,0 +1,313 @@
+/**
+ * @brief mr_compress.cpp
+ * realization of block compression of containers
+ */
+#include "mr_compress.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <istream>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef MR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef MR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static constexpr char magic[] = {'\0', '\xff', 'M', 'R', 'Z', 'B'};
+static constexpr std::size_t frame_header_size = 8;
+
+// Totals, updated once per block
+static std::atomic<long> raw_written, file_written, compress_ns;
+static std::atomic<long> raw_read, file_read, decompress_ns;
+
+bool compression_available(compression_t codec)
+{
+    switch (codec)
+    {
+    case compression_t::none:
+        return true;
+#ifdef MR_HAVE_LZ4
+    case compression_t::lz4:
+        return true;
+#endif
+#ifdef MR_HAVE_ZSTD
+    case compression_t::zstd:
+        return true;
+#endif
+#ifdef MR_HAVE_ZLIB
+    case compression_t::zlib:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *compression_name(compression_t codec)
+{
+    switch (codec)
+    {
+    case compression_t::lz4:
+        return "lz4";
+    case compression_t::zstd:
+        return "zstd";
+    case compression_t::zlib:
+        return "zlib";
+    default:
+        return "none";
+    }
+}
+
+compression_t container_compression(const std::string &path)
+{
+    char header[compressed_header_size];
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return compression_t::none;
+    auto n = ::pread(fd, header, sizeof(header), 0);
+    ::close(fd);
+    if (n != sizeof(header) || std::memcmp(header, magic, sizeof(magic)))
+        return compression_t::none;
+    return static_cast<compression_t>(header[sizeof(magic)]);
+}
+
+std::string compressed_header(compression_t codec)
+{
+    std::string header(magic, sizeof(magic));
+    header += static_cast<char>(codec);
+    header += '\0';
+    return header;
+}
+
+compress_stats_t compress_stats()
+{
+    return {raw_written, file_written, compress_ns / 1000, raw_read, file_read, decompress_ns / 1000};
+}
+
+// Compressed size of a block, 0 if it does not get smaller
+static std::size_t compress_block(compression_t codec, const char *src, std::size_t n, std::vector<char> &dst)
+{
+    switch (codec)
+    {
+#ifdef MR_HAVE_LZ4
+    case compression_t::lz4:
+    {
+        dst.resize(LZ4_compressBound(static_cast<int>(n)));
+        int size = LZ4_compress_default(src, dst.data(), static_cast<int>(n), static_cast<int>(dst.size()));
+        return size > 0 ? size : 0;
+    }
+#endif
+#ifdef MR_HAVE_ZSTD
+    case compression_t::zstd:
+    {
+        dst.resize(ZSTD_compressBound(n));
+        auto size = ZSTD_compress(dst.data(), dst.size(), src, n, 1);
+        return ZSTD_isError(size) ? 0 : size;
+    }
+#endif
+#ifdef MR_HAVE_ZLIB
+    case compression_t::zlib:
+    {
+        uLongf size = compressBound(n);
+        dst.resize(size);
+        return compress2(reinterpret_cast<Bytef *>(dst.data()), &size,
+                         reinterpret_cast<const Bytef *>(src), n, Z_BEST_SPEED) == Z_OK
+                   ? size
+                   : 0;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+static bool decompress_block(compression_t codec, const char *src, std::size_t n, char *dst, std::size_t raw_n)
+{
+    switch (codec)
+    {
+#ifdef MR_HAVE_LZ4
+    case compression_t::lz4:
+        return LZ4_decompress_safe(src, dst, static_cast<int>(n), static_cast<int>(raw_n)) == static_cast<int>(raw_n);
+#endif
+#ifdef MR_HAVE_ZSTD
+    case compression_t::zstd:
+        return ZSTD_decompress(dst, raw_n, src, n) == raw_n;
+#endif
+#ifdef MR_HAVE_ZLIB
+    case compression_t::zlib:
+    {
+        uLongf size = raw_n;
+        return uncompress(reinterpret_cast<Bytef *>(dst), &size, reinterpret_cast<const Bytef *>(src), n) == Z_OK &&
+               size == raw_n;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+static long elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+compress_buf_t::compress_buf_t(std::streambuf *_sink, compression_t _codec, std::size_t block_size,
+                               std::streamoff _sink_offset)
+    : sink(_sink), codec(_codec), raw(std::min(block_size, max_block_size)), sink_offset(_sink_offset)
+{
+    setp(raw.data(), raw.data() + raw.size());
+}
+
+compress_buf_t::~compress_buf_t()
+{
+    flush_block();
+}
+
+bool compress_buf_t::flush_block()
+{
+    std::size_t n = pptr() - pbase();
+    if (!n || failed)
+        return !failed;
+    auto start = std::chrono::steady_clock::now();
+    std::size_t size = compress_block(codec, pbase(), n, packed);
+    compress_ns += elapsed_ns(start);
+    bool stored = (size == 0 || size >= n);
+    if (stored)
+        size = n;
+
+    std::uint32_t frame[2] = {static_cast<std::uint32_t>(n), static_cast<std::uint32_t>(size)};
+    auto payload = stored ? pbase() : packed.data();
+    if (sink->sputn(reinterpret_cast<const char *>(frame), frame_header_size) != frame_header_size ||
+        sink->sputn(payload, size) != static_cast<std::streamsize>(size))
+    {
+        std::cerr << "Cannot write a compressed block\n";
+        failed = true;
+    }
+    sink_offset += frame_header_size + size;
+    raw_written += n;
+    file_written += frame_header_size + size;
+    setp(raw.data(), raw.data() + raw.size());
+    return !failed;
+}
+
+compress_buf_t::int_type compress_buf_t::overflow(int_type c)
+{
+    if (!flush_block())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int compress_buf_t::sync()
+{
+    return (flush_block() && sink->pubsync() == 0) ? 0 : -1;
+}
+
+compress_buf_t::pos_type compress_buf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (off != 0 || dir != std::ios::cur || !(which & std::ios::out) || !flush_block())
+        return pos_type(off_type(-1));
+    return pos_type(sink_offset);
+}
+
+decompress_buf_t::decompress_buf_t(std::streambuf *_source, compression_t _codec, std::streamoff source_offset,
+                                   std::size_t skip)
+    : source(_source), codec(_codec), next_offset(source_offset)
+{
+    start(skip);
+}
+
+bool decompress_buf_t::read_block()
+{
+    std::uint32_t frame[2];
+    auto n = source->sgetn(reinterpret_cast<char *>(frame), frame_header_size);
+    if (n != frame_header_size || frame[0] > max_block_size || frame[1] > frame[0])
+    {
+        if (n != 0)
+            std::cerr << "Broken compressed block at " << next_offset << '\n';
+        return false;
+    }
+    std::size_t raw_n = frame[0], size = frame[1];
+    raw.resize(raw_n);
+    bool ok;
+    if (size == raw_n)
+        ok = source->sgetn(raw.data(), size) == static_cast<std::streamsize>(size);
+    else
+    {
+        packed.resize(size);
+        ok = source->sgetn(packed.data(), size) == static_cast<std::streamsize>(size);
+        auto start = std::chrono::steady_clock::now();
+        ok = ok && decompress_block(codec, packed.data(), size, raw.data(), raw_n);
+        decompress_ns += elapsed_ns(start);
+    }
+    if (!ok)
+    {
+        std::cerr << "Broken compressed block at " << next_offset << '\n';
+        return false;
+    }
+    block_offset = next_offset;
+    next_offset += frame_header_size + size;
+    raw_read += raw_n;
+    file_read += frame_header_size + size;
+    setg(raw.data(), raw.data(), raw.data() + raw_n);
+    return true;
+}
+
+bool decompress_buf_t::start(std::size_t skip)
+{
+    setg(nullptr, nullptr, nullptr);
+    if (!skip)
+        return true;
+    if (!read_block() || skip > static_cast<std::size_t>(egptr() - eback()))
+        return false;
+    gbump(static_cast<int>(skip));
+    return true;
+}
+
+decompress_buf_t::int_type decompress_buf_t::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (!read_block())
+        return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+}
+
+decompress_buf_t::pos_type decompress_buf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (off != 0 || dir != std::ios::cur || !(which & std::ios::in))
+        return pos_type(off_type(-1));
+    // The end of a block is the start of the next frame: an offset of a full block
+    // would spill into the frame bits
+    if (!eback() || gptr() == egptr())
+        return pos_type(next_offset << block_pos_bits);
+    return pos_type(block_offset << block_pos_bits | (gptr() - eback()));
+}
+
+decompress_buf_t::pos_type decompress_buf_t::seekpos(pos_type pos, std::ios::openmode which)
+{
+    std::streamoff p = pos;
+    std::streamoff offset = p ? file_offset(p) : compressed_header_size;
+    if (!(which & std::ios::in) || source->pubseekpos(offset, std::ios::in) != pos_type(offset))
+        return pos_type(off_type(-1));
+    next_offset = offset;
+    return start(p & (max_block_size - 1)) ? pos : pos_type(off_type(-1));
+}
+
+std::streamoff container_file_offset(std::istream &is, std::streamoff pos)
+{
+    return dynamic_cast<decompress_buf_t *>(is.rdbuf()) ? decompress_buf_t::file_offset(pos) : pos;
+}
@@ -0,0 +1,122 @@
+/**
+ * @brief mr_compress.h
+ * block compression of intermediate containers
+ */
+#pragma once
+
+#include <cstddef>
+#include <ios>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Codecs of container blocks; which of them are built in depends
+ * on the libraries found at configuration
+ */
+enum class compression_t
+{
+    none,
+    lz4,
+    zstd,
+    zlib
+};
+
+bool compression_available(compression_t codec);
+const char *compression_name(compression_t codec);
+
+/**
+ * @brief A compressed container is a header: magic and codec, then frames
+ * of blocks: raw size, payload size (equal to raw size - the block is stored raw), payload;
+ * stream positions of such containers are virtual: frame offset in the file
+ * << block_pos_bits | offset in the block
+ */
+constexpr std::size_t compressed_header_size = 8;
+constexpr int block_pos_bits = 24;
+constexpr std::size_t max_block_size = std::size_t(1) << block_pos_bits;
+
+// The codec of a container file, none if it is not compressed
+compression_t container_compression(const std::string &path);
+
+// Header of a container compressed by the codec
+std::string compressed_header(compression_t codec);
+
+/**
+ * @brief Totals of all compressed containers of a run
+ */
+struct compress_stats_t
+{
+    long raw_written = 0;
+    long file_written = 0;
+    long compress_us = 0;
+    long raw_read = 0;
+    long file_read = 0;
+    long decompress_us = 0;
+};
+
+compress_stats_t compress_stats();
+
+/**
+ * @brief Output stream buffer, which cuts data into blocks, compresses and frames
+ * them into a sink stream buffer
+ */
+class compress_buf_t : public std::streambuf
+{
+public:
+    // sink_offset - bytes of the file before the first frame
+    compress_buf_t(std::streambuf *_sink, compression_t _codec, std::size_t block_size, std::streamoff _sink_offset);
+    ~compress_buf_t() override;
+    compress_buf_t(const compress_buf_t &) = delete;
+    compress_buf_t &operator=(const compress_buf_t &) = delete;
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+    // Only tellp() is supported: the position is the size of the file, the pending block included
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+
+private:
+    std::streambuf *sink;
+    compression_t codec;
+    std::vector<char> raw, packed;
+    std::streamoff sink_offset;
+    bool failed = false;
+
+    bool flush_block();
+};
+
+/**
+ * @brief Input stream buffer, which reads frames of a source stream buffer
+ * and gets the blocks decompressed
+ */
+class decompress_buf_t : public std::streambuf
+{
+public:
+    // The source is positioned at file offset of a frame; skip - bytes of its block to skip
+    decompress_buf_t(std::streambuf *_source, compression_t _codec, std::streamoff source_offset, std::size_t skip = 0);
+    decompress_buf_t(const decompress_buf_t &) = delete;
+    decompress_buf_t &operator=(const decompress_buf_t &) = delete;
+
+    // File offset of a virtual position
+    static std::streamoff file_offset(std::streamoff pos) { return pos ? pos >> block_pos_bits : 0; }
+
+protected:
+    int_type underflow() override;
+    // tellg() and seekg() to positions told
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios::openmode which) override;
+
+private:
+    std::streambuf *source;
+    compression_t codec;
+    std::streamoff block_offset = 0; // of the frame in the get area
+    std::streamoff next_offset;      // of the next frame
+    std::vector<char> raw, packed;
+
+    bool read_block();
+    bool start(std::size_t skip);
+};
+
+// File offset of a position of a container stream, compressed or not
+std::streamoff container_file_offset(std::istream &is, std::streamoff pos);
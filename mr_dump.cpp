@@ -0,0 +1,26 @@
+/**
+ * @brief mr_dump.cpp
+ * Debugging tool: prints binary containers as text
+ */
+#include "mr_framework.h"
+#include <filesystem>
+#include <iostream>
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "The use is: mr_dump <container file>...\n";
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::filesystem::exists(argv[i]))
+        {
+            std::cerr << "No such file: " << argv[i] << '\n';
+            return 1;
+        }
+        mr_dump_container(argv[i], std::cout);
+    }
+    return 0;
+}
@@ -4,197 +4,190 @@
  * map-reduce framework, based on files
  */
 #include "mr_framework.h"
+#include "mr_merge.h"
 #include "debug.h"
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <filesystem>
 #include <numeric>
 #include <list>
 #include <string>
 #include <string_view>
-#include <sstream>
 #include <fstream>
-
-// Input and output for container's items
-std::ofstream &operator<<(std::ofstream &os, const citem_t &it)
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The input file, mapped once and shared by all map workers
+static std::unique_ptr<mapped_file_t> input_file;
+static std::mutex input_file_mutex;
+
+// Parse a size with optional K, M or G suffix; -1 if malformed
+static long parse_size(std::string_view s)
 {
-    try
-    {
-        os << it.key << " " << it.val;
-    }
-    catch (std::ofstream::failure &e)
+    long mult = 1;
+    if (s.size() && std::strchr("KMG", s.back()))
     {
-        std::cerr << e.what() << '\n';
-    }
-    return os;
-}
-
-std::ifstream &operator>>(std::ifstream &is, citem_t &it)
-{
-    try
-    {
-        is >> it.key >> it.val;
-    }
-    catch (std::ifstream::failure &e)
-    {
-        std::cerr << e.what() << '\n';
-    }
-    return is;
-}
-
-// Basic sort object
-void basic_sortf_t::operator()(int container_id, pless_t less)
-{
-    std::vector<citem_t> vec;
-    {
-        std::ifstream in(workfile_path(container_id));
-        while (!in.eof())
-        {
-            citem_t it;
-            in >> it;
-            if (it.key.size())
-                vec.push_back(it);
-        }
+        mult = s.back() == 'K' ? 1L << 10 : s.back() == 'M' ? 1L << 20 : 1L << 30;
+        s.remove_suffix(1);
     }
-    mr_delete_container_file(container_id);
-
-    std::sort(vec.begin(), vec.end(), less);
-
-    std::ofstream out(workfile_path(container_id));
-    for (auto it = vec.begin(); it != vec.end(); ++it)
-        out << *it << '\n';
+    long val = 0;
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+    if (ec != std::errc() || ptr != s.data() + s.size() || val < 0)
+        return -1;
+    return val * mult;
 }
 
-/**
- * @brief Realization of shuffle functionnality
- * @param mnum previuos stage number of files
- * @param rnum needed next stage number of files
- */
-void mr_shuffle(int mnum, int rnum)
+bool get_params(int argc, char **argv, int &mnum, int &rnum)
 {
-    auto inp_containers = make_containers_pool<std::ifstream>(mnum);
-    auto out_containers = make_containers_pool<std::ofstream>(rnum, mnum);
-
-    long int out_container_size = i_ceiling(total.load(), static_cast<long>(rnum));
-
-    //
-    auto eq_to_prev = false;
-
-    std::vector<std::pair<citem_t, std::ifstream *>> workset; // elements in comparison
-    auto out_it = out_containers.begin();
-
-    // Preliminarily fill up the workset[]
-    uint i = 0;
-    for (auto it = inp_containers.begin();
-         i < inp_containers.size(); ++i, ++it)
+    constexpr compression_t codecs[] = {compression_t::none, compression_t::lz4, compression_t::zstd,
+                                        compression_t::zlib};
+    if (argc < 3)
     {
-        citem_t inp_item;
-        *it >> inp_item;
-        if (it->eof() || !inp_item.key.size())
-            continue;
-        workset.push_back({inp_item, &(*it)});
+        // Only the codecs built in are offered
+        std::string codec_names;
+        for (auto codec : codecs)
+            if (compression_available(codec))
+                codec_names += std::string(codec_names.size() ? "|" : "") + compression_name(codec);
+        std::cout << "The use is: mapreduce <mnum> <rnum> [options]\n"
+                     "  --shuffle=sequential|parallel\n"
+                     "  --partition=even|balanced  reduce partitions of equal record counts or balanced by sampled keys\n"
+                     "  --sort=prefix|comparison  sort of string keys by 8-byte prefixes or by std::sort\n"
+                     "  --map-memory=<bytes>[K|M|G]  memory budget of a map worker, 0 - unlimited\n"
+                     "  --split-size=<bytes>[K|M|G]  target size of input splits, 0 - a split per map worker\n"
+                     "  --io-buffer=<bytes>[K|M|G]  buffer size of container files, 1M by default\n"
+                     "  --fadvise  ask the kernel to read containers ahead\n"
+                     "  --aio=off|threads|uring  asynchronous read-ahead and write-behind of shuffle merges\n"
+                  << "  --compress=" << codec_names << "  block compression of intermediate containers\n"
+                  << "  --compress-block=<bytes>[K|M]  size of compressed blocks, 256K by default\n"
+                     "  --key-arena=on|off  keep string keys of map buffers and sorts in arenas\n"
+                     "  --backend=file|memory  keep intermediate containers in files or in memory\n"
+                     "  --memory-budget=<bytes>[K|M|G]  memory of the memory backend, 1G by default\n"
+                     "  --metrics=<path>  write JSON report of stage metrics\n"
+                     "  --threads=<n>  size of the thread pool, hardware concurrency by default\n"
+                     "  --pipeline  overlap map, shuffle and reduce stages\n"
+                     "  --resume  go on from the last stage a previous run with the same options has finished\n"
+                     "  --merge-fanin=<n>  number of map runs merged at once in a pipeline\n";
+        return false;
     }
+    mnum = std::atoi(argv[1]);
+    rnum = std::atoi(argv[2]);
 
-    // Fill up output containers
-    std::string prev_key{""};
-    ulong saved = 0;
-    long out_count = 0;
-    while (inp_containers.size())
+    for (int i = 3; i < argc; ++i)
     {
-
-        // Find the minimal element of workset
-        auto cur = std::min_element(workset.begin(),
-                                    workset.end(), [](std::pair<citem_t, std::ifstream *> a, std::pair<citem_t, std::ifstream *> b)
-                                    { return a.first.key < b.first.key; });
-
-        // Is it equal to the previously output element?
-        eq_to_prev = (cur->first.key == prev_key);
-        prev_key = cur->first.key;
-
-        // If current output container is filled up and the current item != previous item
-        // then pass to the next output container
-        if (out_count >= out_container_size && !eq_to_prev)
+        std::string_view arg{argv[i]};
+        bool ok = true;
+        if (arg == "--shuffle=sequential")
+            mr_config.shuffle_mode = shuffle_mode_t::sequential;
+        else if (arg == "--shuffle=parallel")
+            mr_config.shuffle_mode = shuffle_mode_t::parallel;
+        else if (arg == "--partition=even")
+            mr_config.partition_mode = partition_mode_t::even;
+        else if (arg == "--partition=balanced")
+            mr_config.partition_mode = partition_mode_t::balanced;
+        else if (arg == "--sort=prefix")
+            mr_config.sort_mode = sort_mode_t::prefix;
+        else if (arg == "--sort=comparison")
+            mr_config.sort_mode = sort_mode_t::comparison;
+        else if (arg == "--pipeline")
+            mr_config.pipeline = true;
+        else if (arg == "--resume")
+            mr_config.resume = true;
+        else if (arg.starts_with("--merge-fanin="))
+            ok = (mr_config.pipeline_merge_fanin = std::atoi(arg.substr(arg.find('=') + 1).data())) > 1;
+        else if (arg.starts_with("--threads="))
+            ok = (mr_config.threads = std::atoi(arg.substr(arg.find('=') + 1).data())) > 0;
+        else if (arg.starts_with("--metrics="))
+            ok = (mr_config.metrics_path = arg.substr(arg.find('=') + 1)).size();
+        else if (arg.starts_with("--split-size="))
+            ok = (mr_config.split_size = parse_size(arg.substr(arg.find('=') + 1))) >= 0;
+        else if (arg.starts_with("--io-buffer="))
+            ok = (mr_config.io_buffer_size = parse_size(arg.substr(arg.find('=') + 1))) > 0;
+        else if (arg == "--fadvise")
+            mr_config.io_fadvise = true;
+        else if (arg == "--aio=off")
+            mr_config.aio_mode = aio_mode_t::off;
+        else if (arg == "--aio=threads")
+            mr_config.aio_mode = aio_mode_t::threads;
+        else if (arg == "--aio=uring")
+            mr_config.aio_mode = aio_mode_t::uring;
+        else if (arg.starts_with("--compress="))
         {
-            out_count = 0;
-            ++out_it;
+            auto name = arg.substr(arg.find('=') + 1);
+            auto codec = std::find_if(std::begin(codecs), std::end(codecs), [&](compression_t c)
+                                      { return name == compression_name(c); });
+            ok = codec != std::end(codecs);
+            if (ok && !compression_available(*codec))
+            {
+                std::cout << "The codec is not built in: " << name << '\n';
+                return false;
+            }
+            if (ok)
+                mr_config.compression = *codec;
         }
-
-        // Output current item and delete it from workset
-        (*out_it) << cur->first << '\n';
-        out_count++;
-        saved++;
-
-        auto p_cont = cur->second;
-        workset.erase(cur);
-
-        // Replenish workset from curr input container if the container is not empty
-        if (p_cont->eof())
+        else if (arg.starts_with("--compress-block="))
         {
-            auto it = get_container_iterator(p_cont, inp_containers);
-            inp_containers.erase(it);
-            continue;
+            mr_config.compress_block_size = parse_size(arg.substr(arg.find('=') + 1));
+            ok = mr_config.compress_block_size > 0 &&
+                 mr_config.compress_block_size <= static_cast<long>(max_block_size);
         }
-
-        citem_t inp_item;
-        *p_cont >> inp_item;
-        if (!inp_item.key.size())
+        else if (arg == "--key-arena=on")
+            mr_config.key_arena = true;
+        else if (arg == "--key-arena=off")
+            mr_config.key_arena = false;
+        else if (arg == "--backend=file")
+            mr_config.backend = backend_t::file;
+        else if (arg == "--backend=memory")
+            mr_config.backend = backend_t::memory;
+        else if (arg.starts_with("--memory-budget="))
+            ok = (mr_config.memory_budget = parse_size(arg.substr(arg.find('=') + 1))) >= 0;
+        else if (arg.starts_with("--map-memory="))
+            ok = (mr_config.map_memory_budget = parse_size(arg.substr(arg.find('=') + 1))) >= 0;
+        else
+            ok = false;
+
+        if (!ok)
         {
-            auto it = get_container_iterator(p_cont, inp_containers);
-            inp_containers.erase(it);
-            continue;
+            std::cout << "Unknown option: " << arg << '\n';
+            return false;
         }
-        workset.push_back({inp_item, p_cont});
     }
-    for (int i = 0; i < mnum; ++i)
-    {
-        mr_delete_container_file(i);
-    }
-    mr_normalize_container_names();
+    return true;
 }
 
 /**
  * @brief Split input file function
  * @param input_delimiter delimiter of text records in input file
- * @param mnum number of parts to split the file into
- * @return A mnum + 1 -vector of boundaries
+ * @param mnum number of map workers; the file is split into mnum parts or,
+ * if mr_config.split_size is set, into as many parts of about that size, if there are more
+ * @return A vector of number of parts + 1 boundaries
+ * @throw std::system_error, if the input file can't be mapped
  */
 std::vector<long> mr_split_file(char input_delimiter, int mnum)
 {
     std::vector<long> input_vec;
     input_vec.push_back(0);
-
-    try
+    mr_config.input_delimiter = input_delimiter;
+
+    // A split with no input would leave stages without boundaries, so errors go to the caller
+    auto data = mr_input_file().view();
+    auto fsize = data.size();
+    unsigned long nparts = mnum;
+    if (mr_config.split_size > 0)
+        nparts = std::max(nparts, i_ceiling(fsize, static_cast<unsigned long>(mr_config.split_size)));
+    unsigned long chunk = i_ceiling(fsize, nparts);
+
+    // Every boundary follows the first delimiter at or after the end of its chunk
+    for (unsigned long i = 1; i < nparts; ++i)
     {
-        auto path = workfile_path(input_file_id);
-        auto fsize = std::filesystem::file_size(path);
-        std::ifstream f{path};
-
-        unsigned long chunk = i_ceiling(fsize, static_cast<unsigned long>(mnum));
-
-        for (uintmax_t pos = chunk - 1; true; pos += chunk)
-        {
-            for (uintmax_t shift = 0; true; ++shift)
-            {
-                if (pos + shift >= fsize)
-                {
-                    input_vec.push_back(no_pos);
-                    return input_vec;
-                }
-
-                f.seekg(pos + shift, std::ios_base::beg);
-                if (f.peek() == input_delimiter)
-                {
-                    input_vec.push_back(f.tellg() + static_cast<std::basic_istream<char>::pos_type>(1));
-                    break;
-                }
-            }
-        }
-        input_vec.push_back(no_pos);
-        return input_vec;
-    }
-    catch (std::ifstream::failure &e)
-    {
-        std::cerr << e.what() << '\n';
+        auto pos = std::min(i * chunk, fsize);
+        auto p = pos ? std::memchr(data.data() + pos - 1, input_delimiter, fsize - pos + 1) : nullptr;
+        input_vec.push_back(p ? static_cast<const char *>(p) - data.data() + 1 : static_cast<long>(fsize));
     }
+    input_vec.push_back(no_pos);
     return input_vec;
 }
 
@@ -227,27 +220,202 @@ void mr_create_or_clean_directory(std::string directory)
 void mr_init()
 {
     mr_create_or_clean_directory(std::string(output_dir));
+    mr_memory().clear();
+    mr_manifest.clear();
+    std::lock_guard lock(input_file_mutex);
+    input_file.reset();
 }
 
-//
-// ----------------------Auxillaries----------------------------------------
-//
+/**
+ * @brief Initialize the service to go on with containers of a previous run,
+ * as its saved manifest lists them, instead of mr_init()
+ * @return false if there is no manifest, or its containers were kept in memory and are gone
+ */
+bool mr_resume()
+{
+    {
+        std::lock_guard lock(input_file_mutex);
+        input_file.reset();
+    }
+    if (!mr_manifest.load(manifest_path()))
+        return false;
+    for (auto &c : mr_manifest.containers)
+    {
+        auto path = workfile_path(c.id);
+        if (!mr_memory().find(path) && !std::filesystem::exists(path))
+        {
+            mr_manifest.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+mapped_file_t::mapped_file_t(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    struct stat st;
+    if (::fstat(fd, &st) == 0)
+        size = st.st_size;
+    if (size)
+    {
+        auto p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            auto err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        ::madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(p);
+    }
+    ::close(fd);
+}
+
+mapped_file_t::~mapped_file_t()
+{
+    if (data)
+        ::munmap(const_cast<char *>(data), size);
+}
 
-template <typename ConT>
-std::list<ConT> make_containers_pool(int nof_items, int shift)
+const mapped_file_t &mr_input_file()
 {
-    std::list<ConT> containers;
-    for (long i = shift; i < (nof_items + shift); ++i)
-        containers.emplace_back(workfile_path(i));
-    return containers;
+    std::lock_guard lock(input_file_mutex);
+    if (!input_file)
+        input_file = std::make_unique<mapped_file_t>(workfile_path(input_file_id));
+    return *input_file;
 }
 
-template <typename PositiveInt>
-PositiveInt i_ceiling(PositiveInt numerator, PositiveInt denominator)
+container_ofstream_t::container_ofstream_t(std::size_t buffer_size)
+    : stream_buffer_t(buffer_size)
 {
-    return (numerator + denominator - 1) / denominator;
+    // The buffer must be set before the file is opened
+    rdbuf()->pubsetbuf(buffer.get(), buffer_size);
 }
 
+container_ofstream_t::container_ofstream_t(const std::string &path, std::ios::openmode mode, std::size_t buffer_size)
+    : container_ofstream_t(buffer_size)
+{
+    open(path, mode);
+}
+
+container_ofstream_t::~container_ofstream_t()
+{
+    close();
+}
+
+void container_ofstream_t::open(const std::string &path, std::ios::openmode mode)
+{
+    if (mr_config.backend == backend_t::memory)
+    {
+        memory = std::make_unique<memory_writebuf_t>(path, mode & std::ios::app);
+        std::ostream::rdbuf(memory.get());
+        return;
+    }
+    // An appended container goes on in the codec of its header, whatever the setting is
+    std::streamoff size = (mode & std::ios::app) ? file_bytes(path) : 0;
+    auto codec = size ? container_compression(path) : mr_config.compression;
+    std::ofstream::open(path, std::ios::out | mode);
+    if (codec == compression_t::none || !is_open())
+        return;
+    if (!size)
+    {
+        auto header = compressed_header(codec);
+        write(header.data(), header.size());
+        size = header.size();
+    }
+    compressor = std::make_unique<compress_buf_t>(std::ofstream::rdbuf(), codec,
+                                                  mr_config.compress_block_size, size);
+    std::ostream::rdbuf(compressor.get());
+}
+
+void container_ofstream_t::close()
+{
+    // The last block goes to the file buffer before the file is closed
+    if (compressor)
+    {
+        if (compressor->pubsync() != 0)
+            setstate(std::ios::badbit);
+        std::ostream::rdbuf(std::ofstream::rdbuf());
+        compressor.reset();
+    }
+    if (memory)
+    {
+        if (memory->pubsync() != 0)
+            setstate(std::ios::badbit);
+        std::ostream::rdbuf(std::ofstream::rdbuf());
+        memory.reset();
+    }
+    if (is_open())
+        std::ofstream::close();
+}
+
+container_ifstream_t::container_ifstream_t(std::size_t buffer_size)
+    : stream_buffer_t(buffer_size)
+{
+    rdbuf()->pubsetbuf(buffer.get(), buffer_size);
+}
+
+container_ifstream_t::container_ifstream_t(const std::string &path, std::size_t buffer_size)
+    : container_ifstream_t(buffer_size)
+{
+    open(path);
+}
+
+void container_ifstream_t::open(const std::string &path)
+{
+    if (decompressor || memory)
+    {
+        std::istream::rdbuf(std::ifstream::rdbuf());
+        decompressor.reset();
+        memory.reset();
+    }
+    if (auto container = mr_memory().find(path))
+    {
+        memory = std::make_unique<memory_readbuf_t>(std::move(container));
+        std::istream::rdbuf(memory.get());
+        return;
+    }
+    std::ifstream::open(path);
+    if (auto codec = container_compression(path); codec != compression_t::none && is_open())
+    {
+        std::ifstream::rdbuf()->pubseekpos(compressed_header_size);
+        decompressor = std::make_unique<decompress_buf_t>(std::ifstream::rdbuf(), codec, compressed_header_size);
+        std::istream::rdbuf(decompressor.get());
+    }
+    // Readahead is per file, not per descriptor, so another descriptor may ask for it
+    if (mr_config.io_fadvise)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            ::close(fd);
+        }
+    }
+}
+
+std::size_t merge_buffer_size(std::size_t ninputs)
+{
+    constexpr std::size_t min_size = 16 << 10;
+    std::size_t size = mr_config.io_buffer_size;
+    return std::min(size, std::max(min_size, size * 16 / std::max<std::size_t>(ninputs, 1)));
+}
+
+// Templates for the sample jobs' item
+template struct kv_sortf_t<citem_t>;
+template struct kv_parallel_sortf_t<citem_t>;
+template class kv_map_buffer_t<citem_t>;
+template void mr_dump_container<citem_t>(const std::string &path, std::ostream &os);
+template void mr_export_text<citem_t>(int count);
+
+//
+// ----------------------Auxillaries----------------------------------------
+//
+
 std::string workfile_path(int thread_id)
 {
     return std::string(output_dir) + "c" + std::to_string(thread_id);
@@ -257,61 +425,77 @@ void mr_delete_container_file(int thread_id)
 {
     using namespace std::filesystem;
     auto path = workfile_path(thread_id);
+    mr_memory().erase(path);
     if (exists(path))
         remove(path);
 };
 
-void rename_files(int base_num, std::string directory)
+long container_bytes(const std::string &path)
 {
-    using namespace std::filesystem;
-    const directory_iterator _end;
-    for (std::filesystem::directory_iterator it(directory); it != _end; ++it)
-    {
-        if (std::string(it->path().filename()) == std::string(input_file_name))
-            continue;
-        std::filesystem::rename(it->path(),
-                                std::string(it->path().parent_path()) + "/c" + std::to_string(base_num++));
-    }
+    if (auto container = mr_memory().find(path))
+        return container->size;
+    return file_bytes(path);
 }
 
-int get_file_id(std::filesystem::path path)
+std::string manifest_path()
 {
-    std::istringstream is(path.filename());
-    is.get();
-    int id;
-    is >> id;
-    return id;
+    return std::string(output_dir) + "manifest";
 }
 
-void mr_normalize_container_names()
+long mr_manifest_t::records() const
 {
-    using namespace std::filesystem;
-    auto directory = std::string(output_dir);
-    const directory_iterator _end;
-    int count = 0;
-    int max_id = 0;
-    for (std::filesystem::directory_iterator it(directory); it != _end; ++it, ++count)
-    {
-        auto id = get_file_id(it->path());
-        if (id > max_id)
-            max_id = id;
-    }
+    long n = 0;
+    for (auto &c : containers)
+        n += c.records;
+    return n;
+}
 
-    if (max_id == (count - 2))
-        return;
+void mr_manifest_t::commit(std::vector<container_info_t> &&outputs, int _parts)
+{
+    auto inputs = std::move(containers);
+    containers = std::move(outputs);
+    parts = _parts;
+    stage++;
+    save(manifest_path());
+    for (auto &c : inputs)
+        mr_delete_container_file(c.id);
+}
 
-    rename_files(max_id + 1, directory);
-    rename_files(0, directory);
+void mr_manifest_t::clear()
+{
+    stage = 0;
+    parts = 0;
+    containers.clear();
+    next_id = 0;
 }
 
-std::list<std::ifstream>::const_iterator
-get_container_iterator(const std::ifstream *p_con,
-                       const std::list<std::ifstream> &containers)
+/**
+ * @brief Save as text: a header of stage, parts and next id,
+ * then a line of id, bytes and records per container
+ */
+void mr_manifest_t::save(const std::string &path) const
 {
-    for (auto it = containers.begin(); it != containers.end(); ++it)
+    // A manifest is replaced as a whole, never seen half-written
+    auto tmp = path + ".tmp";
     {
-        if (&(*it) == p_con)
-            return it;
+        std::ofstream out(tmp);
+        out << "stage " << stage << "\nparts " << parts << "\nnext_id " << next_id << '\n';
+        for (auto &c : containers)
+            out << c.id << ' ' << c.bytes << ' ' << c.records << '\n';
     }
-    return containers.end();
+    std::filesystem::rename(tmp, path);
+}
+
+bool mr_manifest_t::load(const std::string &path)
+{
+    std::ifstream in(path);
+    std::string name;
+    int _next_id;
+    if (!(in >> name >> stage >> name >> parts >> name >> _next_id))
+        return false;
+    next_id = _next_id;
+    containers.clear();
+    for (container_info_t c; in >> c.id >> c.bytes >> c.records;)
+        containers.push_back(c);
+    return true;
 }
@@ -6,16 +6,33 @@
 #pragma once
 
 #include "debug.h"
+#include "mr_aio.h"
+#include "mr_arena.h"
+#include "mr_compress.h"
+#include "mr_memory.h"
+#include "mr_metrics.h"
+#include "mr_pool.h"
+#include "mr_record.h"
+#include "mr_merge.h"
+#include "mr_sort.h"
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <list>
 #include <thread>
 #include <fstream>
+#include <functional>
+#include <iterator>
 #include <cstring>
 #include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <stdexcept>
 #include <system_error>
+#include <type_traits>
 
 constexpr int input_file_id = -1;
 constexpr char input_file_name[] = "c-1";
@@ -33,183 +50,1139 @@ inline std::atomic<long> total;
  * @return rounded up ratio
  */
 template <typename PositiveInt>
-PositiveInt i_ceiling(PositiveInt numerator, PositiveInt denominator);
+PositiveInt i_ceiling(PositiveInt numerator, PositiveInt denominator)
+{
+    return (numerator + denominator - 1) / denominator;
+}
+
+/**
+ * @brief Shuffle realizations
+ * sequential - a single global merge, cut into equal-sized output containers
+ * parallel - rnum threads, each merges its own key range of all inputs
+ */
+enum class shuffle_mode_t
+{
+    sequential,
+    parallel
+};
+
+/**
+ * @brief How a shuffle cuts its output into reduce partitions; equal keys never straddle two
+ * even - of equal record counts, keys past the count of a partition go on in it
+ * balanced - at split keys of sampled inputs, which minimise the largest partition
+ */
+enum class partition_mode_t
+{
+    even,
+    balanced
+};
+
+/**
+ * @brief Sort realizations of buffers with std::string keys
+ * comparison - std::sort of items by key
+ * prefix - radix sort by 8-byte key prefixes, full keys compared on ties only
+ */
+enum class sort_mode_t
+{
+    comparison,
+    prefix
+};
+
+/**
+ * @brief Framework-wide settings, may be changed by command line flags
+ */
+struct mr_config_t
+{
+    shuffle_mode_t shuffle_mode = shuffle_mode_t::sequential;
+    sort_mode_t sort_mode = sort_mode_t::prefix;
+    // Number of records sampled per output range to find its boundaries
+    long shuffle_samples_per_range = 64;
+    partition_mode_t partition_mode = partition_mode_t::balanced;
+    // Bytes of map output a map worker may hold before spilling a sorted run; 0 - unlimited
+    long map_memory_budget = 0;
+    // Delimiter of records in the input file, as it was split with
+    char input_delimiter = '\n';
+    // Where to write the JSON report of stage metrics; empty - nowhere
+    std::string metrics_path;
+    // Size of the framework-wide thread pool; 0 - hardware concurrency
+    unsigned threads = 0;
+    // Run map, shuffle and reduce as a pipeline, see mr_pipeline.h
+    bool pipeline = false;
+    // Number of ready map runs merged into one while mappers are still running
+    int pipeline_merge_fanin = 8;
+    // Target size of input splits, pulled by map workers from a shared queue;
+    // 0 - a single split per map worker
+    long split_size = 16L << 20;
+    // Buffer size of a container file stream; k-way merges share 16 such buffers between their inputs
+    long io_buffer_size = 1L << 20;
+    // Ask the kernel to read containers ahead, as they are opened
+    bool io_fadvise = false;
+    // Merges read their inputs ahead and write their outputs behind asynchronously
+    aio_mode_t aio_mode = aio_mode_t::off;
+    // Codec of intermediate containers; containers tell their codec themselves, so readers need no setting
+    compression_t compression = compression_t::none;
+    // Bytes of records compressed as a block; a reader holds a block, a seek decompresses one
+    long compress_block_size = 256L << 10;
+    // Where containers are kept; the input file is always a file
+    backend_t backend = backend_t::file;
+    // Bytes of containers the memory backend may hold; a container beyond it goes on in a file
+    long memory_budget = 1L << 30;
+    // String keys of map buffers and sorts are kept in per-worker arenas instead of the heap
+    bool key_arena = true;
+    // Go on from the last stage, which a previous run has finished, see mr_resume()
+    bool resume = false;
+};
+inline mr_config_t mr_config;
+
+/**
+ * @brief A buffer owned by a file stream; it is a base class preceding the stream,
+ * so it outlives the stream's flush on destruction
+ */
+struct stream_buffer_t
+{
+    std::unique_ptr<char[]> buffer;
+    explicit stream_buffer_t(std::size_t size) : buffer(std::make_unique_for_overwrite<char[]>(size)) {}
+};
+
+/**
+ * @brief Output container file with a large buffer of its own: a record costs
+ * a copy into the buffer, the file is written by buffer-sized chunks;
+ * with mr_config.compression the records are compressed by blocks on their way to the buffer;
+ * with the memory backend the container is written into the memory store instead, uncompressed
+ */
+class container_ofstream_t : private stream_buffer_t, public std::ofstream
+{
+public:
+    explicit container_ofstream_t(std::size_t buffer_size = mr_config.io_buffer_size);
+    explicit container_ofstream_t(const std::string &path, std::ios::openmode mode = std::ios::trunc,
+                                  std::size_t buffer_size = mr_config.io_buffer_size);
+    ~container_ofstream_t() override;
+    void open(const std::string &path, std::ios::openmode mode = std::ios::trunc);
+    void close();
+
+private:
+    std::unique_ptr<compress_buf_t> compressor;
+    std::unique_ptr<memory_writebuf_t> memory;
+};
+
+/**
+ * @brief Input container file with a large buffer of its own, read by buffer-sized chunks;
+ * with mr_config.io_fadvise the kernel is asked to read the file ahead on open;
+ * a compressed container is decompressed, its positions are virtual, see mr_compress.h;
+ * a container of the memory store is read from there
+ */
+class container_ifstream_t : private stream_buffer_t, public std::ifstream
+{
+public:
+    explicit container_ifstream_t(std::size_t buffer_size = mr_config.io_buffer_size);
+    explicit container_ifstream_t(const std::string &path, std::size_t buffer_size = mr_config.io_buffer_size);
+    void open(const std::string &path);
+
+private:
+    std::unique_ptr<decompress_buf_t> decompressor;
+    std::unique_ptr<memory_readbuf_t> memory;
+};
+
+// Buffer size of each of n inputs of a k-way merge
+std::size_t merge_buffer_size(std::size_t ninputs);
+
+// The framework-wide engine of asynchronous I/O, made of mr_config.aio_mode on first use
+aio_engine_t &mr_aio();
+
+/**
+ * @brief Open a container as an input of a merge, positioned at 'start';
+ * it is read ahead asynchronously, unless mr_config.aio_mode is off or it is in memory;
+ * a compressed container is decompressed
+ */
+std::unique_ptr<std::istream> open_merge_input(const std::string &path, std::size_t buffer_size,
+                                               std::streamoff start = 0);
+
+/**
+ * @brief Throw, if a merge input has stopped on a read error rather than at its end,
+ * so a merge never takes a failed read for the end of a container
+ */
+void check_merge_input(const std::istream &in, const std::string &path);
+
+/**
+ * @brief Open a container as an output of a merge;
+ * it is written behind asynchronously, unless mr_config.aio_mode is off or the backend
+ * is memory, and compressed with mr_config.compression, if it goes to a file
+ */
+std::unique_ptr<std::ostream> open_merge_output(const std::string &path);
 
 // Declaration of interface functions
 void mr_delete_container_file(int thread_id);
-void mr_normalize_container_names();
+// Size of a container, in the memory store or in a file
+long container_bytes(const std::string &path);
+template <typename Item = citem_t>
+void mr_shuffle(int mnum, int rnum, shuffle_mode_t mode);
+template <typename Item = citem_t>
 void mr_shuffle(int mnum, int rnum);
 std::vector<long> mr_split_file(char input_delimiter, int mnum);
 void mr_create_or_clean_directory(std::string directory);
 void mr_init();
+bool mr_resume();
+template <typename Item = citem_t>
+void mr_dump_container(const std::string &path, std::ostream &os);
+template <typename Item = citem_t>
+void mr_export_text(int count);
+
+// Deals with command line args: mnum, rnum and optional --flags into mr_config
+bool get_params(int argc, char **argv, int &mnum, int &rnum);
+
+// Construct a path from container file integer id
+std::string workfile_path(int _id);
+
+/**
+ * @brief Read-only memory mapping of a whole file
+ */
+class mapped_file_t
+{
+public:
+    explicit mapped_file_t(const std::string &path);
+    ~mapped_file_t();
+    mapped_file_t(const mapped_file_t &) = delete;
+    mapped_file_t &operator=(const mapped_file_t &) = delete;
+    std::string_view view() const { return {data, size}; }
+
+private:
+    const char *data = nullptr;
+    std::size_t size = 0;
+};
+
+// The input file "c-1", mapped on first use and shared by all threads
+const mapped_file_t &mr_input_file();
+
+/**
+ * @brief A container listed in the manifest
+ */
+struct container_info_t
+{
+    int id = 0; // the file is workfile_path(id)
+    long bytes = 0;
+    long records = 0;
+};
+
+/**
+ * @brief Manifest of the containers left by the last finished stage, in their order;
+ * the next stage takes its inputs from it, so containers are never renamed.
+ * It is saved into the work directory after every stage, so a run can be resumed
+ */
+struct mr_manifest_t
+{
+    int stage = 0; // number of finished stages, a pipeline counts as one
+    int parts = 0; // fragments per container; 0 - containers are not partitioned
+    // Fragment p of container i is containers[i * parts + p]
+    std::vector<container_info_t> containers;
+
+    // Reserve n consecutive ids for new containers, never used before in the run
+    int reserve_ids(int n) { return next_id.fetch_add(n); }
+    // Total records of all the containers
+    long records() const;
+    // Replace the containers by outputs of a finished stage and save the manifest;
+    // the replaced containers are deleted only then, so a saved manifest never lists deleted ones
+    void commit(std::vector<container_info_t> &&outputs, int _parts = 0);
+    void clear();
+    void save(const std::string &path) const;
+    bool load(const std::string &path);
+
+private:
+    std::atomic<int> next_id{0};
+};
+inline mr_manifest_t mr_manifest;
 
-// Deals with command line args
-inline bool get_params(int argc, char **argv, int &mnum, int &rnum)
+// The manifest file in the work directory
+std::string manifest_path();
+
+/**
+ * @brief Basic sort object to sort a container or a buffer of items by key; can be overloaded
+ * @tparam Item record type
+ */
+template <typename Item>
+struct kv_sortf_t
 {
-    bool res = true;
+    virtual ~kv_sortf_t() = default;
+    virtual void operator()(int container_id);
+    virtual void operator()(std::vector<Item> &items)
+    {
+        if constexpr (string_key<typename Item::key_type>)
+            if (mr_config.sort_mode == sort_mode_t::prefix)
+                return prefix_sort(items);
+        std::sort(items.begin(), items.end(), key_less_t{});
+    }
+};
+using basic_sortf_t = kv_sortf_t<citem_t>;
 
-    switch (argc)
+/**
+ * @brief Sort object, which sorts a large buffer on the thread pool by sample sort;
+ * its buckets are sorted as the basic sort object does
+ * @tparam Item record type
+ */
+template <typename Item>
+struct kv_parallel_sortf_t : kv_sortf_t<Item>
+{
+    using kv_sortf_t<Item>::operator();
+    void operator()(std::vector<Item> &items) override
     {
-    case 3:
-        mnum = std::atoi(argv[1]);
-        rnum = std::atoi(argv[2]);
-        break;
-    default:
-        std::cout << "The use is: mapreduce <mnum> <rnum>\n";
-        res = false;
-        break;
+        // Smaller buffers are not worth the scatter, nor is a single worker
+        constexpr std::size_t min_parallel_size = 1 << 16;
+        if (items.size() < min_parallel_size || mr_pool().size() < 2)
+            return kv_sortf_t<Item>::operator()(items);
+        sample_sort(items, mr_pool().size() * 4, [this](std::vector<Item> &bucket)
+                    { kv_sortf_t<Item>::operator()(bucket); });
     }
-    return res;
-}
+};
+using parallel_sortf_t = kv_parallel_sortf_t<citem_t>;
 
-// Construct a path from container file integer id
-std::string workfile_path(int _id);
+// Ready-made basic and parallel sort objs
+template <typename Item>
+inline kv_sortf_t<Item> kv_sort;
+inline basic_sortf_t &mr_sort = kv_sort<citem_t>;
+template <typename Item>
+inline kv_parallel_sortf_t<Item> kv_parallel_sort;
+inline parallel_sortf_t &mr_parallel_sort = kv_parallel_sort<citem_t>;
 
 /**
- * @brief Container item - key+val
+ * @brief Basic partitioner object to choose a reducer for an item; can be overloaded
+ * @tparam Item record type
  */
-struct citem_t
+template <typename Item>
+struct kv_partitionf_t
 {
-    std::string key;
-    int val = 0;
-    friend std::ostream &operator<<(std::ostream &os, const citem_t &it);
-    friend std::istream &operator>>(std::istream &os, const citem_t &it);
+    int nparts;
+    explicit kv_partitionf_t(int _nparts) : nparts(_nparts) {}
+    virtual ~kv_partitionf_t() = default;
+    virtual int operator()(const Item &it) = 0;
 };
-std::ofstream &operator<<(std::ofstream &os, const citem_t &it);
-std::ifstream &operator>>(std::ifstream &is, citem_t &it);
+using basic_partitionf_t = kv_partitionf_t<citem_t>;
 
-// ptr to 'less' func for citems
-using pless_t = bool (*)(const citem_t &a, const citem_t &b);
+/**
+ * @brief Partitioner by key hash, equal keys get to the same reducer
+ */
+template <typename Item>
+struct kv_hash_partitionf_t : kv_partitionf_t<Item>
+{
+    using kv_partitionf_t<Item>::kv_partitionf_t;
+    int operator()(const Item &it) override
+    {
+        return static_cast<int>(hash_key(it.key) % this->nparts);
+    }
+};
+using hash_partitionf_t = kv_hash_partitionf_t<citem_t>;
 
-// citem_t compare functions
-inline bool citem_less_key(const citem_t &a, const citem_t &b)
+/**
+ * @brief Base type for combine objects: folds an item into the accumulated one
+ * with an equal key; runs on sorted map output before it is written
+ */
+template <typename Item>
+struct kv_combine_t
 {
-    return a.key < b.key;
-}
+    using item_type = Item;
+    virtual ~kv_combine_t() = default;
+    virtual void operator()(Item &acc, const Item &it) = 0;
+};
+using combine_t = kv_combine_t<citem_t>;
 
-inline bool citem_less_val(const citem_t &a, const citem_t &b)
+/**
+ * @brief Map-side buffer of one worker: collects items per partition,
+ * spills them as sorted runs when the memory budget is exceeded
+ * and writes sorted (and combined, if there is a combiner) containers on finish();
+ * the container of partition p gets id out_id + p
+ */
+template <typename Item>
+class kv_map_buffer_t
 {
-    return a.val < b.val;
-}
+public:
+    kv_map_buffer_t(int _out_id, kv_sortf_t<Item> *_sortf, kv_partitionf_t<Item> *_partf,
+                    kv_combine_t<Item> *_combf, long _budget);
+    void push(Item &&it);
+    // A key in the arena of the buffer, if keys may live there
+    typename Item::key_type make_key(std::string_view key)
+        requires string_key<typename Item::key_type>
+    {
+        if constexpr (arena_key<typename Item::key_type>)
+            return typename Item::key_type(key, &arena);
+        else
+            return typename Item::key_type(key);
+    }
+    void finish();
+    int spills() const { return nspills; }
+    long records_in() const { return nrecords_in; }
+    long records_out() const { return nrecords_out; }
+    long bytes_written() const { return nbytes_written; }
+    // Containers written, one per partition
+    const std::vector<container_info_t> &outputs() const { return infos; }
+    const key_arena_t &keys() const { return arena; }
+
+private:
+    int out_id;
+    kv_sortf_t<Item> *sortf;
+    kv_partitionf_t<Item> *partf;
+    kv_combine_t<Item> *combf;
+    long budget;
+    long bytes = 0;
+    int nspills = 0;
+    long nrecords_in = 0;
+    long nrecords_out = 0;
+    long nbytes_written = 0;
+    key_arena_t arena;                          // of keys of the buffers, freed by every spill
+    std::vector<std::vector<Item>> buffers;     // per partition
+    std::vector<std::vector<std::string>> runs; // spilled run paths per partition
+    std::vector<container_info_t> infos;        // per partition
+
+    std::string container_path(std::size_t part) const;
+    void spill();
+};
+using map_buffer_t = kv_map_buffer_t<citem_t>;
 
 /**
- * @brief Basic sort object to sort a container; can be overloaded
+ * @brief Sink for results of a map worker: takes any number of key/value pairs
+ * and stores them right into the worker's map buffer, owned by the framework
  */
-struct basic_sortf_t
+template <typename Item>
+class kv_emitter_t
 {
-    virtual void operator()(int container_id, pless_t less = citem_less_key);
-    int dumm;
+public:
+    using K = typename Item::key_type;
+    using V = typename Item::value_type;
+
+    explicit kv_emitter_t(kv_map_buffer_t<Item> &_buffer) : buffer(_buffer) {}
+
+    // An empty key marks no item
+    void operator()(Item &&it)
+    {
+        if (empty_key(it.key))
+            return;
+        total++;
+        buffer.push(std::move(it));
+    }
+    // String keys are emitted as views, copied once into the arena of the buffer
+    void operator()(std::string_view key, const V &val)
+        requires string_key<K>
+    {
+        (*this)(Item{buffer.make_key(key), val});
+    }
+    void operator()(const K &key, const V &val)
+        requires(!string_key<K>)
+    {
+        (*this)(Item{key, val});
+    }
+
+private:
+    kv_map_buffer_t<Item> &buffer;
 };
-// Ready-made basic sort obj
-inline basic_sortf_t mr_sort;
+using emitter_t = kv_emitter_t<citem_t>;
 
 /**
  * @brief Prototype for transform or accumulate objects
  */
-struct IFunc
+template <typename Item>
+struct kv_func_t
 {
-    citem_t result;
-    virtual citem_t operator()(std::ifstream &in) = 0;
+    using item_type = Item;
+    Item result;
+    virtual Item operator()(std::ifstream &in) = 0;
 };
+using IFunc = kv_func_t<citem_t>;
 
 // Base type for transform objects, needed for templ magic
-struct map_t : IFunc
+template <typename Item>
+struct kv_map_t : kv_func_t<Item>
 {
 };
+using map_t = kv_map_t<citem_t>;
 
 // Base type for accumulate objects, needed for templ magic
-struct reduce_t : IFunc
+template <typename Item>
+struct kv_reduce_t : kv_func_t<Item>
+{
+};
+using reduce_t = kv_reduce_t<citem_t>;
+
+/**
+ * @brief Base type for transform objects, which get records of the memory-mapped
+ * input as views, without copying; a view is valid during the call only
+ */
+template <typename Item>
+struct kv_record_map_t
+{
+    using item_type = Item;
+    virtual Item operator()(std::string_view record) = 0;
+};
+using record_map_t = kv_record_map_t<citem_t>;
+
+/**
+ * @brief Base type for transform objects, which get records of the memory-mapped
+ * input as views and emit zero, one or many key/value pairs per record
+ */
+template <typename Item>
+struct kv_emit_map_t
+{
+    using item_type = Item;
+    virtual void operator()(std::string_view record, kv_emitter_t<Item> &emit) = 0;
+};
+using emit_map_t = kv_emit_map_t<citem_t>;
+
+template <typename Item>
+class kv_group_reader_t;
+
+/**
+ * @brief Values of one key of a sorted container, an input range: values are read
+ * from the container as it is iterated, the group is never held in memory;
+ * values, which a reducer does not iterate, are skipped
+ */
+template <typename Item>
+class kv_values_t
 {
+public:
+    using V = typename Item::value_type;
+
+    class iterator
+    {
+    public:
+        using value_type = V;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        const V &operator*() const { return reader->item.val; }
+        const V *operator->() const { return &reader->item.val; }
+        iterator &operator++()
+        {
+            reader->advance();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return !reader->in_group; }
+
+    private:
+        friend class kv_values_t;
+        explicit iterator(kv_group_reader_t<Item> *_reader) : reader(_reader) {}
+        kv_group_reader_t<Item> *reader = nullptr;
+    };
+
+    iterator begin() const { return iterator(&reader); }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    friend class kv_group_reader_t<Item>;
+    explicit kv_values_t(kv_group_reader_t<Item> &_reader) : reader(_reader) {}
+    kv_group_reader_t<Item> &reader;
+};
+
+/**
+ * @brief Reader of a sorted container by groups of equal keys
+ */
+template <typename Item>
+class kv_group_reader_t
+{
+public:
+    using K = typename Item::key_type;
+
+    explicit kv_group_reader_t(std::istream &_in) : in(_in) { advance(); }
+
+    // Go to the next key, skipping the rest of the current group; false at the end of the container
+    bool next_key()
+    {
+        while (in_group)
+            advance();
+        if (!has_item)
+            return false;
+        group_key = item.key;
+        in_group = true;
+        return true;
+    }
+
+    const K &key() const { return group_key; }
+    kv_values_t<Item> values() { return kv_values_t<Item>(*this); }
+    long records() const { return count; }
+
+private:
+    friend class kv_values_t<Item>::iterator;
+    std::istream &in;
+    Item item;
+    K group_key{};
+    bool has_item = false;
+    bool in_group = false;
+    long count = 0;
+
+    void advance()
+    {
+        has_item = read_item(in, item);
+        count += has_item;
+        // Keys are sorted, the group lasts while the keys do not grow
+        in_group = in_group && has_item && !(group_key < item.key);
+    }
+};
+
+/**
+ * @brief Sink for results of a grouped reducer, written right into its output container
+ */
+template <typename Item>
+class kv_output_t
+{
+public:
+    using K = typename Item::key_type;
+    using V = typename Item::value_type;
+
+    explicit kv_output_t(std::ostream &_os) : os(_os) {}
+
+    void operator()(const Item &it)
+    {
+        write_item(os, it);
+        total++;
+    }
+    void operator()(const K &key, const V &val) { (*this)(Item{key, val}); }
+
+    long records() const { return total; }
+
+private:
+    std::ostream &os;
+    long total = 0;
+};
+
+/**
+ * @brief Base type for accumulate objects, which the framework calls once per distinct key
+ * of a sorted container, with the key and the range of its values; a call, and finish()
+ * after the last key, may output any number of items
+ */
+template <typename Item>
+struct kv_group_reduce_t
+{
+    using item_type = Item;
+    virtual void operator()(const typename Item::key_type &key, kv_values_t<Item> values,
+                            kv_output_t<Item> &out) = 0;
+    virtual void finish([[maybe_unused]] kv_output_t<Item> &out) {}
+    virtual ~kv_group_reduce_t() = default;
+};
+using group_reduce_t = kv_group_reduce_t<citem_t>;
+
+// Any of transform object types
+template <typename T>
+concept map_functor = std::derived_from<T, kv_map_t<typename T::item_type>> ||
+                      std::derived_from<T, kv_record_map_t<typename T::item_type>> ||
+                      std::derived_from<T, kv_emit_map_t<typename T::item_type>>;
+
+// Any of accumulate object types
+template <typename T>
+concept reduce_functor = std::derived_from<T, kv_reduce_t<typename T::item_type>> ||
+                         std::derived_from<T, kv_group_reduce_t<typename T::item_type>>;
+
+/**
+ * @brief Call f for every record of [start, end) part of data, cut by delimiter
+ */
+template <typename F>
+void for_each_record(std::string_view data, std::size_t start, std::size_t end, char delimiter, F &&f)
+{
+    while (start < end)
+    {
+        auto p = static_cast<const char *>(std::memchr(data.data() + start, delimiter, end - start));
+        std::size_t next = p ? p - data.data() : end;
+        f(data.substr(start, next - start));
+        start = next + 1;
+    }
+}
+
+/**
+ * @brief Shared queue of input splits, map workers pull them until it is empty
+ */
+class split_queue_t
+{
+public:
+    explicit split_queue_t(const std::vector<long> &_boundaries) : boundaries(_boundaries) {}
+
+    // Take the next [start, end) split; false when all of them are taken
+    bool pop(long &start, long &end)
+    {
+        auto i = next++;
+        if (i + 1 >= boundaries.size())
+            return false;
+        start = boundaries[i];
+        end = boundaries[i + 1];
+        return true;
+    }
+
+private:
+    const std::vector<long> &boundaries;
+    std::atomic<std::size_t> next{0};
 };
 
 /**
  * @brief Worker function template to proceed one thread of execution
- * @tparam T
+ * @tparam T transform or accumulate object type, its item_type is the record type
+ * @tparam C combine object type (void - no combiner)
  * @param _inp_id Input file id
  * @param _out_id Output file id
  * @param start_pos Starting position in input file (if splitted)
  * @param end_pos End position in input file (if splitted)
  * @param sortf Pointer to sorting object
+ * @param partf Pointer to partitioner object; if set, a map output
+ * is written into partf->nparts fragments instead of a single container
+ * @param tm Pointer to the thread's metrics
+ * @param splits Queue of input splits; if set, a map worker maps the splits it pulls
+ * from the queue into a single output, instead of [start_pos, end_pos)
+ * @param out_info Where to put info of the output container (of partf->nparts
+ * fragments with ids _out_id + part, if partf is set)
  */
-template <typename T>
+template <typename T, typename C = void>
 void thread_worker(int _inp_id,
                    int _out_id,
                    long int start_pos,
                    long int end_pos,
-                   basic_sortf_t *sortf)
+                   kv_sortf_t<typename T::item_type> *sortf,
+                   kv_partitionf_t<typename T::item_type> *partf = nullptr,
+                   thread_metrics_t *tm = nullptr,
+                   split_queue_t *splits = nullptr,
+                   container_info_t *out_info = nullptr)
 
 {
+    using Item = typename T::item_type;
+    thread_probe_t probe(tm);
+    thread_metrics_t dummy;
+    if (!tm)
+        tm = &dummy;
     {
-        std::ifstream ic(workfile_path(_inp_id));
-        std::ofstream oc(workfile_path(_out_id));
-        ic.seekg(start_pos);
         T mdf;
-        // A map branch
-        if constexpr (std::derived_from<T, map_t>)
+        // A map branch: results are buffered, sorted in memory and written once
+        if constexpr (map_functor<T>)
+        {
+            std::unique_ptr<kv_combine_t<Item>> combf;
+            if constexpr (!std::is_void_v<C>)
+                combf = std::make_unique<C>();
+            kv_map_buffer_t<Item> buffer(_out_id, sortf, partf, combf.get(), mr_config.map_memory_budget);
+            kv_emitter_t<Item> emit(buffer);
+
+            std::function<void(long, long)> map_split;
+            // Only a map of streams reads through a container stream
+            std::unique_ptr<container_ifstream_t> ic;
+            if constexpr (std::derived_from<T, kv_map_t<Item>>)
+            {
+                ic = std::make_unique<container_ifstream_t>(workfile_path(_inp_id));
+                map_split = [&](long start, long end)
+                {
+                    ic->clear();
+                    ic->seekg(start);
+                    tm->bytes_read += ((end == no_pos) ? file_bytes(workfile_path(_inp_id)) : end) - start;
+                    while (!ic->eof() &&
+                           (end == no_pos || (end != no_pos && ic->tellg() < end)))
+                    {
+                        tm->records_in++;
+                        emit(mdf(*ic));
+                    }
+                };
+            }
+            else
+            {
+                // Records are cut from the mapping of the input file by delimiter search;
+                // mr_stage_t never gives these maps a container
+                assert(_inp_id == input_file_id);
+                auto data = mr_input_file().view();
+                map_split = [&, data](long start, long end)
+                {
+                    auto on_record = [&](std::string_view record)
+                    {
+                        tm->records_in++;
+                        if constexpr (std::derived_from<T, kv_emit_map_t<Item>>)
+                            mdf(record, emit);
+                        else
+                            emit(mdf(record));
+                    };
+                    std::size_t end_ = (end == no_pos) ? data.size() : end;
+                    tm->bytes_read += end_ - start;
+                    for_each_record(data, start, end_, mr_config.input_delimiter, on_record);
+                };
+            }
+            if (splits)
+            {
+                long start, end;
+                while (splits->pop(start, end))
+                {
+                    map_split(start, end);
+                    tm->counters["splits"]++;
+                }
+            }
+            else
+                map_split(start_pos, end_pos);
+            buffer.finish();
+            if (out_info)
+                std::copy(buffer.outputs().begin(), buffer.outputs().end(), out_info);
+            tm->records_out = buffer.records_out();
+            tm->bytes_written = buffer.bytes_written();
+            tm->counters["spills"] = buffer.spills();
+            tm->counters["key_allocs"] = buffer.keys().allocations();
+            tm->counters["key_alloc_us"] = buffer.keys().allocated_ns() / 1000;
+            tm->counters["key_arena_chunks"] = buffer.keys().chunks();
+            tm->counters["key_arena_peak_bytes"] = buffer.keys().peak_bytes();
+            if (combf)
+            {
+                tm->counters["combine_in"] = buffer.records_in();
+                tm->counters["combine_out"] = buffer.records_out();
+            }
+        }
+        // A grouped reduce branch: the container is read once, a group at a time
+        else if constexpr (std::derived_from<T, kv_group_reduce_t<Item>>)
         {
-            while (!ic.eof() &&
-                   (end_pos == no_pos || (end_pos != no_pos && ic.tellg() < end_pos)))
+            container_ifstream_t ic(workfile_path(_inp_id));
             {
-                auto res = mdf(ic);
-                total++;
-                oc << res << '\n';
+                container_ofstream_t oc(workfile_path(_out_id));
+                kv_output_t<Item> out(oc);
+                kv_group_reader_t<Item> groups(ic);
+                while (groups.next_key())
+                    mdf(groups.key(), groups.values(), out);
+                mdf.finish(out);
+                tm->records_in = groups.records();
+                tm->records_out = out.records();
+                tm->bytes_written = oc.tellp();
             }
+            tm->bytes_read = container_bytes(workfile_path(_inp_id));
+            if (out_info)
+                *out_info = {_out_id, tm->bytes_written, tm->records_out};
         }
         // A reduce branch
-        else if constexpr (std::derived_from<T, reduce_t>)
+        else if constexpr (reduce_functor<T>)
         {
-            citem_t res;
+            container_ifstream_t ic(workfile_path(_inp_id));
+            ic.seekg(start_pos);
+            container_ofstream_t oc(workfile_path(_out_id));
+            Item res;
+            tm->bytes_read = container_bytes(workfile_path(_inp_id));
             while (!ic.eof() && (end_pos == no_pos || (end_pos != no_pos && ic.tellg() < end_pos)))
             {
                 res = mdf(ic);
+                // The call, which hits the end, has read no record
+                if (ic)
+                    tm->records_in++;
             }
-            oc << res << '\n';
-            mr_delete_container_file(_inp_id);
+            oc << res;
+            tm->records_out = 1;
+            tm->bytes_written = oc.tellp();
+            if (out_info)
+                *out_info = {_out_id, tm->bytes_written, tm->records_out};
         }
     }
-    // Sorting chunk of map branch
-    if constexpr (std::derived_from<T, map_t>)
-    {
-        if (sortf)
-            (*sortf)(_out_id);
-    }
 }
 
 /**
- * @brief A template for map or reduce object, which creates working threads
- * @tparam T
+ * @brief A template for map or reduce object, which runs its workers as tasks
+ * of the framework-wide thread pool, so count may exceed the number of cores;
+ * takes the input containers from mr_manifest, unless the input file is split,
+ * and commits its outputs there
+ * @tparam T transform or accumulate object type, its item_type is the record type
+ * @tparam C combine object type, run on map output (void - no combiner)
  */
-template <typename T>
+template <typename T, typename C = void>
 struct mr_stage_t
 {
-    std::list<std::thread> threads;
+    using Item = typename T::item_type;
+    static_assert(std::is_void_v<C> || std::derived_from<C, kv_combine_t<Item>>);
 
     mr_stage_t(int count,
                const std::vector<long> &input_boundaries,
-               basic_sortf_t *sortf = &mr_sort)
+               kv_sortf_t<Item> *sortf = &kv_sort<Item>,
+               kv_partitionf_t<Item> *partf = nullptr)
     {
-
         bool splitted_input = (input_boundaries.size() != 0);
+        // Containers hold binary items, which only a map of streams reads; record and emit maps
+        // cut text records out of the input file
+        if constexpr (std::derived_from<T, kv_record_map_t<Item>> || std::derived_from<T, kv_emit_map_t<Item>>)
+            if (!splitted_input)
+                throw std::invalid_argument(type_name(typeid(T)) +
+                                            ": a record or emit map works on the split input file only");
+
+        stage_probe_t probe(map_functor<T> ? "map" : "reduce", count, type_name(typeid(T)));
+        assert(splitted_input ||
+               (!mr_manifest.parts && mr_manifest.containers.size() == static_cast<std::size_t>(count)));
+        // More splits than workers: the workers pull them from a shared queue
+        bool dynamic_splits = (input_boundaries.size() > static_cast<std::size_t>(count) + 1);
+        split_queue_t splits(input_boundaries);
+        // Only a map output is partitioned
+        int parts = (map_functor<T> && partf) ? partf->nparts : 0;
+        int nouts = std::max(parts, 1);
+        int out_base = mr_manifest.reserve_ids(count * nouts);
+        std::vector<container_info_t> outputs(count * nouts);
+        task_group_t tasks;
         for (int i = 0; i < count; ++i)
         {
-            threads.push_back(std::thread(thread_worker<T>,
-                                          splitted_input ? input_file_id : i, i + count,
-                                          splitted_input ? input_boundaries[i] : 0,
-                                          splitted_input ? input_boundaries[i + 1] : no_pos,
-                                          sortf));
+            tasks.run([=, &input_boundaries, &probe, &splits, &outputs]
+                      { thread_worker<T, C>(splitted_input ? input_file_id : mr_manifest.containers[i].id,
+                                            out_base + i * nouts,
+                                            splitted_input && !dynamic_splits ? input_boundaries[i] : 0,
+                                            splitted_input && !dynamic_splits ? input_boundaries[i + 1] : no_pos,
+                                            sortf, partf, probe.thread(i),
+                                            dynamic_splits ? &splits : nullptr, &outputs[i * nouts]); });
         }
-        for (auto it = threads.begin(); it != threads.end(); ++it)
-            it->join();
-        mr_normalize_container_names();
+        tasks.wait();
+
+        // Fragments stay apart until mr_shuffle merges them per reducer
+        mr_manifest.commit(std::move(outputs), parts);
     }
 };
 
 // Some yet other openers
 std::string workfile_path(int _id);
 
-std::list<std::ifstream>::const_iterator
-get_container_iterator(const std::ifstream *p_con,
-                       const std::list<std::ifstream> &containers);
-
 template <typename ConT>
-std::list<ConT> make_containers_pool(int nof_items, int shift = 0);
+std::list<ConT> make_containers_pool(int nof_items, int shift = 0)
+{
+    std::list<ConT> containers;
+    for (long i = shift; i < (nof_items + shift); ++i)
+        containers.emplace_back(workfile_path(i));
+    return containers;
+}
+
+//
+// ----------------------Realization of templates----------------------------
+//
+
+// Basic sort object
+template <typename Item>
+void kv_sortf_t<Item>::operator()(int container_id)
+{
+    key_arena_t arena(mr_config.key_arena);
+    std::vector<Item> vec;
+    {
+        container_ifstream_t in(workfile_path(container_id));
+        for (Item it; read_item(in, it);)
+            vec.push_back(arena_copy(it, &arena));
+    }
+    mr_delete_container_file(container_id);
+
+    (*this)(vec);
+
+    container_ofstream_t out(workfile_path(container_id));
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+        out << *it;
+}
+
+/**
+ * @brief Writer of items to a container file; with a combiner, collapses
+ * every run of equal keys (of sorted items) into a single item
+ */
+template <typename Item>
+class run_writer_t
+{
+public:
+    run_writer_t(const std::string &path, kv_combine_t<Item> *_combf, std::ios::openmode mode = std::ios::trunc)
+        : out(path, mode), combf(_combf)
+    {
+    }
+
+    void push(const Item &it)
+    {
+        if (!combf)
+        {
+            out << it;
+            count++;
+        }
+        else if (pending && acc.key == it.key)
+            (*combf)(acc, it);
+        else
+        {
+            flush();
+            acc = it;
+            pending = true;
+        }
+    }
+
+    // Write out the pending item; returns number of items written
+    long finish()
+    {
+        flush();
+        bytes = out.tellp();
+        out.close();
+        return count;
+    }
+
+    long written_bytes() const { return bytes; }
+
+private:
+    container_ofstream_t out;
+    kv_combine_t<Item> *combf;
+    Item acc;
+    bool pending = false;
+    long count = 0;
+    long bytes = 0;
+
+    void flush()
+    {
+        if (pending)
+        {
+            out << acc;
+            count++;
+            pending = false;
+        }
+    }
+};
+
+template <typename Item>
+kv_map_buffer_t<Item>::kv_map_buffer_t(int _out_id, kv_sortf_t<Item> *_sortf, kv_partitionf_t<Item> *_partf,
+                                       kv_combine_t<Item> *_combf, long _budget)
+    : out_id(_out_id), sortf(_sortf), partf(_partf), combf(_sortf ? _combf : nullptr), budget(_budget),
+      arena(mr_config.key_arena, !mr_config.metrics_path.empty()), buffers(_partf ? _partf->nparts : 1), runs(buffers.size()), infos(buffers.size())
+{
+    for (std::size_t p = 0; p < infos.size(); ++p)
+        infos[p].id = out_id + p;
+}
+
+template <typename Item>
+std::string kv_map_buffer_t<Item>::container_path(std::size_t part) const
+{
+    return workfile_path(out_id + part);
+}
+
+template <typename Item>
+void kv_map_buffer_t<Item>::push(Item &&it)
+{
+    nrecords_in++;
+    bytes += sizeof(Item);
+    if constexpr (string_key<typename Item::key_type>)
+        bytes += it.key.size();
+    auto &buffer = buffers[partf ? (*partf)(it) : 0];
+    // Keys made elsewhere are copied into the arena
+    if constexpr (arena_key<typename Item::key_type>)
+    {
+        if (it.key.get_allocator().resource() != &arena)
+            buffer.push_back(arena_copy(it, &arena));
+        else
+            buffer.push_back(std::move(it));
+    }
+    else
+        buffer.push_back(std::move(it));
+    if (budget && bytes >= budget)
+        spill();
+}
+
+// Write every partition buffer as a sorted run (or append it to its container, if unsorted)
+template <typename Item>
+void kv_map_buffer_t<Item>::spill()
+{
+    for (std::size_t p = 0; p < buffers.size(); ++p)
+    {
+        if (!buffers[p].size())
+            continue;
+        if (sortf)
+        {
+            (*sortf)(buffers[p]);
+            auto path = container_path(p) + ".run" + std::to_string(runs[p].size());
+            run_writer_t<Item> out(path, combf);
+            for (auto &it : buffers[p])
+                out.push(it);
+            out.finish();
+            nbytes_written += out.written_bytes();
+            runs[p].push_back(path);
+        }
+        else
+        {
+            run_writer_t<Item> out(container_path(p), nullptr, nspills ? std::ios::app : std::ios::trunc);
+            for (auto &it : buffers[p])
+                out.push(it);
+            infos[p].records += out.finish();
+            nbytes_written += out.written_bytes();
+        }
+        buffers[p].clear();
+    }
+    // No key of the buffers is left
+    arena.release();
+    bytes = 0;
+    nspills++;
+}
+
+template <typename Item>
+void kv_map_buffer_t<Item>::finish()
+{
+    for (std::size_t p = 0; p < buffers.size(); ++p)
+    {
+        // Everything fits in memory, the container is written at once
+        if (!runs[p].size())
+        {
+            if (sortf)
+                (*sortf)(buffers[p]);
+            run_writer_t<Item> out(container_path(p), combf, (!sortf && nspills) ? std::ios::app : std::ios::trunc);
+            for (auto &it : buffers[p])
+                out.push(it);
+            infos[p].records += out.finish();
+            nbytes_written += out.written_bytes();
+            // Appended to, the container may have been written by spills too
+            infos[p].bytes = (!sortf && nspills) ? container_bytes(container_path(p)) : out.written_bytes();
+            nrecords_out += infos[p].records;
+            buffers[p].clear();
+            continue;
+        }
+
+        // Otherwise the rest is spilled too, and all the runs are merged
+        if (buffers[p].size())
+        {
+            (*sortf)(buffers[p]);
+            auto path = container_path(p) + ".run" + std::to_string(runs[p].size());
+            run_writer_t<Item> out(path, combf);
+            for (auto &it : buffers[p])
+                out.push(it);
+            out.finish();
+            nbytes_written += out.written_bytes();
+            runs[p].push_back(path);
+            buffers[p].clear();
+        }
+
+        std::list<container_ifstream_t> files;
+        std::vector<std::ifstream *> inputs;
+        for (auto &path : runs[p])
+            inputs.push_back(&files.emplace_back(path, merge_buffer_size(runs[p].size())));
+        {
+            run_writer_t<Item> out(container_path(p), combf);
+            for (kway_merge_t<std::ifstream, Item> merge(inputs); !merge.empty(); merge.pop())
+                out.push(merge.top());
+            infos[p].records = out.finish();
+            infos[p].bytes = out.written_bytes();
+            nrecords_out += infos[p].records;
+            nbytes_written += out.written_bytes();
+        }
+        files.clear();
+        for (auto &path : runs[p])
+            std::filesystem::remove(path);
+    }
+}
+
+/**
+ * @brief Print a binary container as text, an item per line
+ * @param path container file
+ * @param os output stream
+ */
+template <typename Item>
+void mr_dump_container(const std::string &path, std::ostream &os)
+{
+    container_ifstream_t in(path);
+    for (Item it; in >> it;)
+        os << it << '\n';
+}
+
+/**
+ * @brief Convert the first count containers of the manifest into text files c0 - c<count-1>;
+ * the run is over then, the manifest is cleared
+ * @param count number of containers
+ */
+template <typename Item>
+void mr_export_text(int count)
+{
+    // All the texts are written before any of them takes its name
+    for (int i = 0; i < count; ++i)
+    {
+        std::ofstream out(workfile_path(i) + ".txt");
+        mr_dump_container<Item>(workfile_path(mr_manifest.containers[i].id), out);
+    }
+    // The run is over before its containers are deleted, it is never resumed from deleted ones
+    std::filesystem::remove(manifest_path());
+    for (int i = 0; i < count; ++i)
+    {
+        mr_delete_container_file(mr_manifest.containers[i].id);
+        std::filesystem::rename(workfile_path(i) + ".txt", workfile_path(i));
+    }
+    mr_manifest.clear();
+}
+
+// The sample jobs' item is built once, in the library
+extern template struct kv_sortf_t<citem_t>;
+extern template struct kv_parallel_sortf_t<citem_t>;
+extern template class kv_map_buffer_t<citem_t>;
+extern template void mr_dump_container<citem_t>(const std::string &path, std::ostream &os);
+extern template void mr_export_text<citem_t>(int count);
+
+#include "mr_shuffle.h"
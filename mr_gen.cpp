@@ -0,0 +1,59 @@
+/**
+ * @brief mr_gen.cpp
+ * Tool generating synthetic inputs for benchmarks;
+ * what is generated is printed as one JSON object
+ */
+#include "mr_gen.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+int main(int argc, char **argv)
+{
+    gen_config_t config;
+    std::string path;
+    bool force = false;
+    auto usage = [](int code)
+    {
+        std::cout << "The use is: mr_gen --out=PATH [flags]\n"
+                  << "  --out=PATH              file to write, required\n"
+                  << "  --force                 overwrite PATH if it exists\n"
+                  << gen_flags_usage();
+        return code;
+    };
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--out="))
+            path = arg.substr(6);
+        else if (arg == "--force")
+            force = true;
+        else if (!parse_gen_flag(arg, config))
+            return usage(arg == "--help" ? 0 : 1);
+    }
+    if (path.empty())
+        return usage(1);
+    if (!force && std::filesystem::exists(path))
+    {
+        std::cerr << path << " exists, use --force to overwrite it\n";
+        return 1;
+    }
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+    {
+        std::cerr << "Cannot open " << path << '\n';
+        return 1;
+    }
+    auto stats = generate_input(config, out);
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Cannot write " << path << '\n';
+        return 1;
+    }
+    write_gen_json(std::cout, config, stats);
+    std::cout << '\n';
+    return 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * @brief mr_gen.h
+ * synthetic inputs: text records of keys with a given number of distinct keys,
+ * distribution of key lengths and skew of key frequencies
+ */
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Distribution of key lengths between gen_config_t::min_len and max_len
+ * uniform - every length is equally likely
+ * normal - around the middle, the range is +-3 sigma
+ * exponential - short keys are common, long ones are rare
+ */
+enum class length_dist_t
+{
+    uniform,
+    normal,
+    exponential
+};
+
+/**
+ * @brief Parameters of a synthetic input
+ */
+struct gen_config_t
+{
+    long records = 1L << 16;
+    long keys = 0; // distinct keys, 0 - a key per record
+    int min_len = 5;
+    int max_len = 10;
+    length_dist_t length_dist = length_dist_t::uniform;
+    double skew = 0; // Zipf exponent of key frequencies, 0 - uniform
+    bool email = true; // keys are local parts, a domain is appended, as in the sample input
+    std::uint64_t seed = 1;
+};
+
+/**
+ * @brief What has been generated
+ */
+struct gen_stats_t
+{
+    long records = 0;
+    long bytes = 0;
+    long keys = 0;           // distinct keys to draw from
+    double top_key_share = 0; // probability of the most frequent key
+};
+
+inline const char *length_dist_name(length_dist_t dist)
+{
+    switch (dist)
+    {
+    case length_dist_t::normal:
+        return "normal";
+    case length_dist_t::exponential:
+        return "exponential";
+    default:
+        return "uniform";
+    }
+}
+
+/**
+ * @brief Parse one generator flag: --records=, --keys=, --key-len=MIN:MAX,
+ * --len-dist=uniform|normal|exponential, --skew=, --format=email|plain, --seed=
+ * @return false if the argument is not a generator flag or is malformed
+ */
+inline bool parse_gen_flag(std::string_view arg, gen_config_t &config)
+{
+    auto eq = arg.find('=');
+    if (eq == arg.npos)
+        return false;
+    auto name = arg.substr(0, eq), value = arg.substr(eq + 1);
+    auto number = [&](auto &out)
+    {
+        auto [p, ec] = std::from_chars(value.data(), value.data() + value.size(), out);
+        return ec == std::errc() && p == value.data() + value.size();
+    };
+    if (name == "--records")
+        return number(config.records) && config.records >= 0;
+    if (name == "--keys")
+        return number(config.keys) && config.keys >= 0;
+    if (name == "--skew")
+        return number(config.skew) && config.skew >= 0;
+    if (name == "--seed")
+        return number(config.seed);
+    if (name == "--key-len")
+    {
+        auto colon = value.find(':');
+        auto full = value;
+        value = full.substr(0, colon);
+        if (!number(config.min_len))
+            return false;
+        if (colon == full.npos)
+            config.max_len = config.min_len;
+        else
+        {
+            value = full.substr(colon + 1);
+            if (!number(config.max_len))
+                return false;
+        }
+        return config.min_len > 0 && config.min_len <= config.max_len;
+    }
+    if (name == "--len-dist")
+    {
+        for (auto dist : {length_dist_t::uniform, length_dist_t::normal, length_dist_t::exponential})
+            if (value == length_dist_name(dist))
+            {
+                config.length_dist = dist;
+                return true;
+            }
+        return false;
+    }
+    if (name == "--format")
+    {
+        config.email = (value == "email");
+        return config.email || value == "plain";
+    }
+    return false;
+}
+
+inline const char *gen_flags_usage()
+{
+    return "  --records=N             records to generate\n"
+           "  --keys=N                distinct keys, 0 - a key per record\n"
+           "  --key-len=MIN:MAX       range of key lengths\n"
+           "  --len-dist=uniform|normal|exponential\n"
+           "                          distribution of key lengths\n"
+           "  --skew=S                Zipf exponent of key frequencies, 0 - uniform\n"
+           "  --format=email|plain    append a domain to keys or not\n"
+           "  --seed=N                seed of the random generator\n";
+}
+
+/**
+ * @brief Generator of keys: a table of distinct keys, drawn from by their Zipf ranks;
+ * with a key per record there is no table, every key is made as it is asked for,
+ * so an input may be larger than memory
+ */
+class key_generator_t
+{
+public:
+    explicit key_generator_t(const gen_config_t &_config)
+        : config(_config), gen(_config.seed)
+    {
+        if (!config.keys)
+            return;
+        table.reserve(config.keys);
+        for (long i = 0; i < config.keys; ++i)
+            table.push_back(make_key());
+        if (config.skew > 0)
+        {
+            // Cumulative weights of ranks, a rank is found by binary search
+            cdf.resize(config.keys);
+            double sum = 0;
+            for (long i = 0; i < config.keys; ++i)
+                cdf[i] = sum += 1 / std::pow(i + 1, config.skew);
+            for (auto &c : cdf)
+                c /= sum;
+        }
+    }
+
+    // Key of the next record
+    const std::string &operator()()
+    {
+        if (!config.keys)
+            return current = make_key();
+        if (cdf.empty())
+            return table[std::uniform_int_distribution<long>(0, table.size() - 1)(gen)];
+        auto u = std::uniform_real_distribution<double>(0, 1)(gen);
+        auto rank = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return table[std::min<long>(rank, table.size() - 1)];
+    }
+
+    long keys() const { return config.keys ? config.keys : config.records; }
+    double top_key_share() const
+    {
+        if (!cdf.empty())
+            return cdf[0];
+        return keys() ? 1.0 / keys() : 0;
+    }
+
+private:
+    const gen_config_t &config;
+    std::mt19937_64 gen;
+    std::vector<std::string> table;
+    std::vector<double> cdf;
+    std::string current; // the last key made, with a key per record
+
+    int key_length()
+    {
+        int lo = config.min_len, hi = config.max_len;
+        double len;
+        switch (config.length_dist)
+        {
+        case length_dist_t::normal:
+            len = std::normal_distribution<double>((lo + hi) / 2.0, (hi - lo) / 6.0)(gen);
+            break;
+        case length_dist_t::exponential:
+            len = lo + std::exponential_distribution<double>(4.0 / std::max(1, hi - lo))(gen);
+            break;
+        default:
+            return std::uniform_int_distribution<int>(lo, hi)(gen);
+        }
+        return std::clamp(static_cast<int>(std::lround(len)), lo, hi);
+    }
+
+    std::string make_key()
+    {
+        static const char *domains[] = {"@mail.com", "@example.com", "@yahoo.com", "@gmail.com"};
+        std::uniform_int_distribution<int> letter('a', 'z'), dom(0, 3);
+        std::string s;
+        for (int i = key_length(); i > 0; --i)
+            s += static_cast<char>(letter(gen));
+        if (config.email)
+            s += domains[dom(gen)];
+        return s;
+    }
+};
+
+/**
+ * @brief Write config.records keys, one per line
+ */
+inline gen_stats_t generate_input(const gen_config_t &config, std::ostream &os)
+{
+    key_generator_t keys(config);
+    gen_stats_t stats{config.records, 0, keys.keys(), keys.top_key_share()};
+    for (long i = 0; i < config.records; ++i)
+    {
+        auto &key = keys();
+        os << key << '\n';
+        stats.bytes += key.size() + 1;
+    }
+    return stats;
+}
+
+// The config and the stats as one JSON object
+inline void write_gen_json(std::ostream &os, const gen_config_t &config, const gen_stats_t &stats)
+{
+    os << "{\"records\":" << stats.records << ",\"bytes\":" << stats.bytes
+       << ",\"keys\":" << stats.keys << ",\"min_len\":" << config.min_len
+       << ",\"max_len\":" << config.max_len
+       << ",\"len_dist\":\"" << length_dist_name(config.length_dist)
+       << "\",\"skew\":" << config.skew << ",\"top_key_share\":" << stats.top_key_share
+       << ",\"format\":\"" << (config.email ? "email" : "plain") << "\",\"seed\":" << config.seed
+       << "}";
+}
@@ -0,0 +1,242 @@
+/**
+ * @brief mr_memory.cpp
+ * realization of the in-memory backend of containers
+ */
+#include "mr_memory.h"
+#include "mr_framework.h"
+#include <algorithm>
+#include <iostream>
+
+memory_container_t::~memory_container_t()
+{
+    store.release(starts.back());
+}
+
+bool memory_container_t::grow()
+{
+    std::size_t size = std::min(min_chunk << std::min<std::size_t>(chunks.size(), 16), max_chunk);
+    if (!store.reserve(size))
+        return false;
+    chunks.push_back(std::make_unique_for_overwrite<char[]>(size));
+    starts.push_back(starts.back() + size);
+    return true;
+}
+
+std::size_t memory_container_t::chunk_of(std::size_t offset) const
+{
+    return std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+}
+
+std::shared_ptr<memory_container_t> memory_store_t::create(const std::string &path)
+{
+    auto container = std::make_shared<memory_container_t>(*this);
+    std::lock_guard lock(mutex);
+    containers[path] = container;
+    return container;
+}
+
+std::shared_ptr<memory_container_t> memory_store_t::find(const std::string &path) const
+{
+    std::lock_guard lock(mutex);
+    auto it = containers.find(path);
+    return it == containers.end() ? nullptr : it->second;
+}
+
+bool memory_store_t::erase(const std::string &path)
+{
+    std::lock_guard lock(mutex);
+    return containers.erase(path);
+}
+
+void memory_store_t::clear()
+{
+    std::lock_guard lock(mutex);
+    containers.clear();
+    nfallbacks = 0;
+}
+
+bool memory_store_t::reserve(std::size_t n)
+{
+    long now = used += n;
+    if (now > mr_config.memory_budget)
+    {
+        used -= n;
+        return false;
+    }
+    for (long p = peak; p < now && !peak.compare_exchange_weak(p, now);)
+        ;
+    return true;
+}
+
+void memory_store_t::release(std::size_t n)
+{
+    used -= n;
+}
+
+memory_store_t &mr_memory()
+{
+    static memory_store_t store;
+    return store;
+}
+
+memory_writebuf_t::memory_writebuf_t(const std::string &_path, bool append) : path(_path)
+{
+    if (append)
+        container = mr_memory().find(path);
+    if (container)
+    {
+        // Appended to, the container goes on from its end
+        chunk = container->nchunks();
+        if (container->size < container->start(chunk))
+        {
+            chunk = container->chunk_of(container->size);
+            auto p = container->chunk(chunk) - container->start(chunk);
+            setp(p + container->size, p + container->start(chunk + 1));
+        }
+    }
+    else if (append && file_bytes(path))
+        fall_back(true);
+    else
+        container = mr_memory().create(path);
+}
+
+memory_writebuf_t::~memory_writebuf_t()
+{
+    sync();
+}
+
+void memory_writebuf_t::commit()
+{
+    if (container && pbase())
+        container->size = container->start(chunk) + (pptr() - container->chunk(chunk));
+}
+
+bool memory_writebuf_t::fall_back(bool append_file)
+{
+    if (!file.open(path, std::ios::out | std::ios::binary | (append_file ? std::ios::app : std::ios::trunc)))
+    {
+        std::cerr << "Cannot open " << path << '\n';
+        failed = true;
+        return false;
+    }
+    file_size = append_file ? file_bytes(path) : 0;
+    if (container)
+    {
+        // What is in memory goes first, then the memory is freed
+        mr_memory().count_fallback();
+        commit();
+        for (std::size_t k = 0; k < container->nchunks() && container->start(k) < container->size; ++k)
+        {
+            std::streamsize n = std::min(container->start(k + 1), container->size) - container->start(k);
+            if (file.sputn(container->chunk(k), n) != n)
+                failed = true;
+        }
+        file_size = container->size;
+        mr_memory().erase(path);
+        container.reset();
+    }
+    std::size_t size = mr_config.io_buffer_size;
+    file_buffer = std::make_unique_for_overwrite<char[]>(size);
+    setp(file_buffer.get(), file_buffer.get() + size);
+    return !failed;
+}
+
+memory_writebuf_t::int_type memory_writebuf_t::overflow(int_type c)
+{
+    if (failed)
+        return traits_type::eof();
+    if (container)
+    {
+        commit();
+        std::size_t next = pbase() ? chunk + 1 : container->nchunks();
+        if (container->grow())
+        {
+            chunk = next;
+            setp(container->chunk(chunk), container->chunk(chunk) + (container->start(chunk + 1) - container->start(chunk)));
+        }
+        else if (!fall_back(false))
+            return traits_type::eof();
+    }
+    else
+    {
+        std::streamsize n = pptr() - pbase();
+        if (file.sputn(pbase(), n) != n)
+        {
+            failed = true;
+            return traits_type::eof();
+        }
+        file_size += n;
+        setp(pbase(), epptr());
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int memory_writebuf_t::sync()
+{
+    if (container)
+    {
+        commit();
+        return 0;
+    }
+    if (failed || traits_type::eq_int_type(overflow(traits_type::eof()), traits_type::eof()))
+        return -1;
+    return file.pubsync();
+}
+
+memory_writebuf_t::pos_type memory_writebuf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (off != 0 || dir != std::ios::cur || !(which & std::ios::out))
+        return pos_type(off_type(-1));
+    commit();
+    return pos_type(container ? container->size : file_size + (pptr() - pbase()));
+}
+
+memory_readbuf_t::memory_readbuf_t(std::shared_ptr<const memory_container_t> _container)
+    : container(std::move(_container))
+{
+    position(0);
+}
+
+memory_readbuf_t::pos_type memory_readbuf_t::position(std::size_t offset)
+{
+    if (offset >= container->size)
+    {
+        setg(nullptr, nullptr, nullptr);
+        base = container->size;
+        return pos_type(offset == container->size ? off_type(offset) : off_type(-1));
+    }
+    auto k = container->chunk_of(offset);
+    auto p = container->chunk(k);
+    base = container->start(k);
+    setg(p, p + (offset - base), p + (std::min(container->start(k + 1), container->size) - base));
+    return pos_type(off_type(offset));
+}
+
+memory_readbuf_t::int_type memory_readbuf_t::underflow()
+{
+    std::size_t offset = base + (gptr() - eback());
+    if (offset >= container->size)
+        return traits_type::eof();
+    position(offset);
+    return traits_type::to_int_type(*gptr());
+}
+
+memory_readbuf_t::pos_type memory_readbuf_t::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which)
+{
+    if (!(which & std::ios::in))
+        return pos_type(off_type(-1));
+    off_type from = dir == std::ios::beg ? 0 : dir == std::ios::end ? container->size : base + (gptr() - eback());
+    if (from + off < 0)
+        return pos_type(off_type(-1));
+    return position(from + off);
+}
+
+memory_readbuf_t::pos_type memory_readbuf_t::seekpos(pos_type pos, std::ios::openmode which)
+{
+    return seekoff(off_type(pos), std::ios::beg, which);
+}
@@ -0,0 +1,150 @@
+/**
+ * @brief mr_memory.h
+ * in-memory backend of containers: a container is held in chunks of memory
+ * instead of a file, as long as the memory budget allows
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Where containers are kept
+ * file - files of the output directory
+ * memory - the memory store; a container, which exceeds its budget, goes on in a file
+ */
+enum class backend_t
+{
+    file,
+    memory
+};
+
+class memory_store_t;
+
+/**
+ * @brief Bytes of a container in memory: an arena of chunks, which grow in size
+ * from min_chunk to max_chunk; chunks are never moved, so a position stays valid
+ */
+class memory_container_t
+{
+public:
+    static constexpr std::size_t min_chunk = 64 << 10;
+    static constexpr std::size_t max_chunk = 4 << 20;
+
+    explicit memory_container_t(memory_store_t &_store) : store(_store) {}
+    ~memory_container_t();
+    memory_container_t(const memory_container_t &) = delete;
+    memory_container_t &operator=(const memory_container_t &) = delete;
+
+    // Add a chunk, if the budget allows
+    bool grow();
+
+    std::size_t nchunks() const { return chunks.size(); }
+    char *chunk(std::size_t k) const { return chunks[k].get(); }
+    // Offset of the chunk in the container; start(nchunks()) is the capacity
+    std::size_t start(std::size_t k) const { return starts[k]; }
+    // Chunk holding the offset
+    std::size_t chunk_of(std::size_t offset) const;
+
+    // Bytes written; set by the writer
+    std::size_t size = 0;
+
+private:
+    memory_store_t &store;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::vector<std::size_t> starts{0};
+};
+
+/**
+ * @brief Containers in memory by their paths; memory of the chunks is counted against the budget
+ */
+class memory_store_t
+{
+public:
+    // An empty container at the path, replacing one, which is there
+    std::shared_ptr<memory_container_t> create(const std::string &path);
+    // The container at the path, nullptr if it is not in memory
+    std::shared_ptr<memory_container_t> find(const std::string &path) const;
+    bool erase(const std::string &path);
+    void clear();
+
+    // Take n bytes of the budget; false if they would exceed it
+    bool reserve(std::size_t n);
+    void release(std::size_t n);
+
+    long bytes() const { return used; }
+    long peak_bytes() const { return peak; }
+    // Number of containers, which have gone on in files for lack of budget
+    long fallbacks() const { return nfallbacks; }
+    void count_fallback() { nfallbacks++; }
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<memory_container_t>> containers;
+    std::atomic<long> used{0};
+    std::atomic<long> peak{0};
+    std::atomic<long> nfallbacks{0};
+};
+
+// The framework-wide store, its budget is mr_config.memory_budget
+memory_store_t &mr_memory();
+
+/**
+ * @brief Output stream buffer writing a container into the store; when the budget
+ * is exceeded, the container is moved into its file and is written on there
+ */
+class memory_writebuf_t : public std::streambuf
+{
+public:
+    memory_writebuf_t(const std::string &_path, bool append);
+    ~memory_writebuf_t() override;
+    memory_writebuf_t(const memory_writebuf_t &) = delete;
+    memory_writebuf_t &operator=(const memory_writebuf_t &) = delete;
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+    // Only tellp() is supported: the position is the size of the container
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+
+private:
+    std::string path;
+    std::shared_ptr<memory_container_t> container;
+    std::size_t chunk = 0; // of the put area
+    std::filebuf file;     // after a fallback
+    std::unique_ptr<char[]> file_buffer;
+    std::size_t file_size = 0;
+    bool failed = false;
+
+    void commit();
+    bool fall_back(bool append_file);
+};
+
+/**
+ * @brief Input stream buffer reading a container of the store, a chunk at a time
+ */
+class memory_readbuf_t : public std::streambuf
+{
+public:
+    explicit memory_readbuf_t(std::shared_ptr<const memory_container_t> _container);
+
+protected:
+    int_type underflow() override;
+    // tellg() and seekg() to any offset of the container
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios::openmode which) override;
+
+private:
+    std::shared_ptr<const memory_container_t> container;
+    std::size_t base = 0; // offset of the get area in the container
+
+    pos_type position(std::size_t offset);
+};
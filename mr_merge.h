@@ -0,0 +1,89 @@
+/**
+ * @brief mr_merge.h
+ * k-way merge engine over sorted containers
+ */
+#pragma once
+
+#include "mr_record.h"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Binary heap over input cursors, yields items of all inputs in key order;
+ * equal keys are yielded in order of input index (stable merge)
+ * @tparam ReaderT input type, for which 'bool read_item(ReaderT &, Item &)' exists
+ * @tparam Item record type
+ */
+template <typename ReaderT, typename Item = citem_t>
+class kway_merge_t
+{
+public:
+    explicit kway_merge_t(const std::vector<ReaderT *> &_inputs)
+        : inputs(_inputs)
+    {
+        heap.reserve(inputs.size());
+        for (std::size_t i = 0; i < inputs.size(); ++i)
+        {
+            entry_t e{Item{}, i};
+            if (read_item(*inputs[i], e.item))
+                heap.push_back(std::move(e));
+        }
+        for (std::size_t i = heap.size() / 2; i-- > 0;)
+            sift_down(i);
+    }
+
+    bool empty() const { return heap.empty(); }
+
+    // The minimal item; valid until the next pop()
+    const Item &top() const { return heap.front().item; }
+
+    // Index of the input the minimal item came from
+    std::size_t top_source() const { return heap.front().src; }
+
+    // Drop the minimal item and replenish the heap from its input
+    void pop()
+    {
+        auto &head = heap.front();
+        if (!read_item(*inputs[head.src], head.item))
+        {
+            if (heap.size() > 1)
+                head = std::move(heap.back());
+            heap.pop_back();
+        }
+        if (!heap.empty())
+            sift_down(0);
+    }
+
+private:
+    struct entry_t
+    {
+        Item item;
+        std::size_t src;
+    };
+
+    std::vector<ReaderT *> inputs;
+    std::vector<entry_t> heap;
+
+    static bool less(const entry_t &a, const entry_t &b)
+    {
+        auto cmp = compare_keys(a.item.key, b.item.key);
+        return cmp < 0 || (cmp == 0 && a.src < b.src);
+    }
+
+    void sift_down(std::size_t i)
+    {
+        auto n = heap.size();
+        entry_t e = std::move(heap[i]);
+        for (auto child = 2 * i + 1; child < n; child = 2 * i + 1)
+        {
+            if (child + 1 < n && less(heap[child + 1], heap[child]))
+                ++child;
+            if (!less(heap[child], e))
+                break;
+            heap[i] = std::move(heap[child]);
+            i = child;
+        }
+        heap[i] = std::move(e);
+    }
+};
@@ -0,0 +1,202 @@
+/**
+ * @brief mr_metrics.cpp
+ * realization of performance counters
+ */
+#include "mr_metrics.h"
+#include "mr_framework.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <time.h>
+#include <sys/resource.h>
+
+std::string type_name(const std::type_info &ti)
+{
+    int status = 0;
+    std::unique_ptr<char, void (*)(void *)> name(abi::__cxa_demangle(ti.name(), nullptr, nullptr, &status), std::free);
+    return status == 0 ? name.get() : ti.name();
+}
+
+static double thread_cpu_sec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long process_peak_rss_kb()
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+long file_bytes(const std::string &path)
+{
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    return ec ? 0 : static_cast<long>(size);
+}
+
+void metrics_t::add(stage_metrics_t &&stage)
+{
+    std::lock_guard lock(mutex);
+    stages.push_back(std::move(stage));
+}
+
+stage_metrics_t metrics_t::last_stage() const
+{
+    std::lock_guard lock(mutex);
+    return stages.size() ? stages.back() : stage_metrics_t{};
+}
+
+static void write_counters(std::ostream &os, const std::map<std::string, long> &counters)
+{
+    os << "{";
+    for (auto it = counters.begin(); it != counters.end(); ++it)
+        os << (it == counters.begin() ? "" : ", ") << '"' << it->first << "\": " << it->second;
+    os << "}";
+}
+
+// A JSON string of any text, keys may hold quotes and control characters
+static void write_string(std::ostream &os, const std::string &s)
+{
+    static const char hex[] = "0123456789abcdef";
+    os << '"';
+    for (unsigned char c : s)
+    {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (c < 0x20)
+            os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+void metrics_t::write_json(std::ostream &os) const
+{
+    std::lock_guard lock(mutex);
+    os << "{\n  \"stages\": [";
+    for (std::size_t i = 0; i < stages.size(); ++i)
+    {
+        auto &s = stages[i];
+        thread_metrics_t sum;
+        double max_busy = 0;
+        for (auto &t : s.threads)
+        {
+            sum.records_in += t.records_in;
+            sum.records_out += t.records_out;
+            sum.bytes_read += t.bytes_read;
+            sum.bytes_written += t.bytes_written;
+            max_busy = std::max(max_busy, t.busy_sec);
+        }
+
+        os << (i ? "," : "") << "\n    {\"name\": \"" << s.name << "\", \"variant\": \"" << s.variant
+           << "\", \"wall_sec\": " << s.wall_sec << ", \"max_thread_busy_sec\": " << max_busy
+           << ", \"process_peak_rss_kb\": " << s.process_peak_rss_kb
+           << ", \"records_in\": " << sum.records_in << ", \"records_out\": " << sum.records_out
+           << ", \"bytes_read\": " << sum.bytes_read << ", \"bytes_written\": " << sum.bytes_written
+           << ", \"counters\": ";
+        write_counters(os, s.counters);
+        if (s.heavy_hitters.size())
+        {
+            os << ",\n     \"heavy_hitters\": [";
+            for (std::size_t j = 0; j < s.heavy_hitters.size(); ++j)
+            {
+                os << (j ? ", " : "") << "{\"key\": ";
+                write_string(os, s.heavy_hitters[j].key);
+                os << ", \"records\": " << s.heavy_hitters[j].records << "}";
+            }
+            os << "]";
+        }
+        os << ",\n     \"threads\": [";
+        for (std::size_t j = 0; j < s.threads.size(); ++j)
+        {
+            auto &t = s.threads[j];
+            os << (j ? "," : "") << "\n      {\"busy_sec\": " << t.busy_sec << ", \"cpu_sec\": " << t.cpu_sec
+               << ", \"records_in\": " << t.records_in << ", \"records_out\": " << t.records_out
+               << ", \"bytes_read\": " << t.bytes_read << ", \"bytes_written\": " << t.bytes_written
+               << ", \"counters\": ";
+            write_counters(os, t.counters);
+            os << "}";
+        }
+        os << "]}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+stage_probe_t::stage_probe_t(std::string name, int nthreads, std::string variant)
+    : start(std::chrono::steady_clock::now()), compress_start(compress_stats()),
+      fallbacks_start(mr_memory().fallbacks())
+{
+    metrics.name = std::move(name);
+    metrics.variant = std::move(variant);
+    metrics.threads.resize(nthreads);
+}
+
+stage_probe_t::~stage_probe_t()
+{
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+    metrics.wall_sec = wall.count();
+    metrics.process_peak_rss_kb = process_peak_rss_kb();
+
+    // Time spent on codecs against the I/O they saved; stages of a pipeline overlap, so they share it
+    auto cs = compress_stats();
+    long raw_written = cs.raw_written - compress_start.raw_written;
+    long raw_read = cs.raw_read - compress_start.raw_read;
+    if (raw_written || raw_read)
+    {
+        auto &c = metrics.counters;
+        c["compress_raw_bytes"] = raw_written;
+        c["compress_file_bytes"] = cs.file_written - compress_start.file_written;
+        c["compress_us"] = cs.compress_us - compress_start.compress_us;
+        c["decompress_raw_bytes"] = raw_read;
+        c["decompress_file_bytes"] = cs.file_read - compress_start.file_read;
+        c["decompress_us"] = cs.decompress_us - compress_start.decompress_us;
+        if (raw_written)
+            c["compress_ratio_pct"] = c["compress_file_bytes"] * 100 / raw_written;
+        c["io_bytes_saved"] = raw_written - c["compress_file_bytes"] + raw_read - c["decompress_file_bytes"];
+    }
+
+    // Containers held in memory at the end of the stage, and those, which went to files
+    if (mr_memory().peak_bytes())
+    {
+        metrics.counters["memory_bytes"] = mr_memory().bytes();
+        metrics.counters["memory_peak_bytes"] = mr_memory().peak_bytes();
+        metrics.counters["memory_fallbacks"] = mr_memory().fallbacks() - fallbacks_start;
+    }
+    mr_metrics.add(std::move(metrics));
+}
+
+thread_probe_t::thread_probe_t(thread_metrics_t *_metrics)
+    : metrics(_metrics), start(std::chrono::steady_clock::now()), cpu_start(thread_cpu_sec())
+{
+}
+
+thread_probe_t::~thread_probe_t()
+{
+    if (!metrics)
+        return;
+    std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+    metrics->busy_sec += busy.count();
+    metrics->cpu_sec += thread_cpu_sec() - cpu_start;
+}
+
+void mr_report_metrics()
+{
+    if (!mr_config.metrics_path.size())
+        return;
+    std::ofstream out(mr_config.metrics_path);
+    if (!out)
+    {
+        std::cerr << "Cannot write metrics to " << mr_config.metrics_path << '\n';
+        return;
+    }
+    mr_metrics.write_json(out);
+}
@@ -0,0 +1,118 @@
+/**
+ * @brief mr_metrics.h
+ * performance counters of stages and their threads,
+ * reported as JSON at the end of a run
+ */
+#pragma once
+
+#include "mr_compress.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+/**
+ * @brief Counters of one thread of a stage
+ */
+struct thread_metrics_t
+{
+    double busy_sec = 0; // wall time of the thread's work
+    double cpu_sec = 0;
+    long records_in = 0;
+    long records_out = 0;
+    long bytes_read = 0;
+    long bytes_written = 0;
+    std::map<std::string, long> counters; // stage specific, e.g. spills
+};
+
+/**
+ * @brief A key of so many records, that it may fill a reduce partition on its own
+ */
+struct heavy_hitter_t
+{
+    std::string key; // text form
+    long records = 0; // estimated by samples
+};
+
+/**
+ * @brief Counters of one map, reduce or shuffle stage
+ */
+struct stage_metrics_t
+{
+    std::string name;
+    std::string variant; // functor type or shuffle mode
+    double wall_sec = 0;
+    long process_peak_rss_kb = 0; // of the whole process so far, not of the stage alone
+    std::map<std::string, long> counters;
+    std::vector<heavy_hitter_t> heavy_hitters; // of a shuffle, the heaviest first
+    std::vector<thread_metrics_t> threads;
+};
+
+/**
+ * @brief Metrics of all the stages of a run
+ */
+class metrics_t
+{
+public:
+    void add(stage_metrics_t &&stage);
+    void write_json(std::ostream &os) const;
+    // Metrics of the last finished stage, empty if there was none
+    stage_metrics_t last_stage() const;
+
+private:
+    mutable std::mutex mutex;
+    std::vector<stage_metrics_t> stages;
+};
+inline metrics_t mr_metrics;
+
+/**
+ * @brief Measures a stage during its lifetime and adds its metrics
+ * to mr_metrics on destruction; compression of containers and use of the memory
+ * store during the stage are added to its counters
+ */
+class stage_probe_t
+{
+public:
+    stage_probe_t(std::string name, int nthreads, std::string variant = "");
+    ~stage_probe_t();
+    stage_probe_t(const stage_probe_t &) = delete;
+    stage_probe_t &operator=(const stage_probe_t &) = delete;
+
+    stage_metrics_t &stage() { return metrics; }
+    thread_metrics_t *thread(int i) { return &metrics.threads[i]; }
+
+private:
+    stage_metrics_t metrics;
+    std::chrono::steady_clock::time_point start;
+    compress_stats_t compress_start;
+    long fallbacks_start;
+};
+
+/**
+ * @brief Measures busy and cpu time of the current thread during its lifetime
+ */
+class thread_probe_t
+{
+public:
+    explicit thread_probe_t(thread_metrics_t *_metrics);
+    ~thread_probe_t();
+    thread_probe_t(const thread_probe_t &) = delete;
+    thread_probe_t &operator=(const thread_probe_t &) = delete;
+
+private:
+    thread_metrics_t *metrics;
+    std::chrono::steady_clock::time_point start;
+    double cpu_start;
+};
+
+// Readable name of a type
+std::string type_name(const std::type_info &ti);
+
+// Size of a file, 0 if there is no such file
+long file_bytes(const std::string &path);
+
+// Write the report into mr_config.metrics_path, if it is set
+void mr_report_metrics();
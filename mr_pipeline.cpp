@@ -0,0 +1,9 @@
+/**
+ * @brief mr_pipeline.cpp
+ * realization of pipelined execution of map, shuffle and reduce stages
+ */
+#include "mr_pipeline.h"
+
+template void mr_run_pipeline<citem_t>(int mnum, int rnum,
+                                       const map_task_t &map_task, const std::string &map_variant,
+                                       const reduce_task_t &reduce_task, const std::string &reduce_variant);
@@ -0,0 +1,280 @@
+/**
+ * @brief mr_pipeline.h
+ * pipelined execution of map, shuffle and reduce stages:
+ * finished map runs are merged while other mappers are still running,
+ * reducers start on output containers as soon as they are cut
+ */
+#pragma once
+
+#include "mr_framework.h"
+#include "mr_merge.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A map task: (mapper index, output container id, its metrics, info of the output to fill)
+using map_task_t = std::function<void(int, int, thread_metrics_t *, container_info_t *)>;
+// A reduce task: (input container id, output container id, its metrics, info of the output to fill)
+using reduce_task_t = std::function<void(int, int, thread_metrics_t *, container_info_t *)>;
+
+/**
+ * @brief Run mnum map tasks, merge their sorted runs into rnum containers
+ * and reduce them, with no barrier between the stages; commits rnum reduce
+ * results to mr_manifest, as the three stages run one by one do
+ * @tparam Item record type
+ */
+template <typename Item>
+void mr_run_pipeline(int mnum, int rnum,
+                     const map_task_t &map_task, const std::string &map_variant,
+                     const reduce_task_t &reduce_task, const std::string &reduce_variant);
+
+/**
+ * @brief A template for map, shuffle and reduce stages run as a pipeline,
+ * the same as a map mr_stage_t, mr_shuffle(mnum, rnum) and a reduce mr_stage_t
+ * @tparam M transform object type
+ * @tparam R accumulate object type
+ * @tparam C combine object type, run on map output (void - no combiner)
+ */
+template <typename M, typename R, typename C = void>
+struct mr_pipeline_t
+{
+    using Item = typename M::item_type;
+    static_assert(map_functor<M> && reduce_functor<R> && std::is_same_v<typename R::item_type, Item>);
+    static_assert(std::is_void_v<C> || std::derived_from<C, kv_combine_t<Item>>);
+
+    // Mappers work on the split input file only
+    mr_pipeline_t(int mnum, int rnum,
+                  const std::vector<long> &input_boundaries,
+                  kv_sortf_t<Item> *sortf = &kv_sort<Item>)
+    {
+        // More splits than mappers: the mappers pull them from a shared queue
+        bool dynamic_splits = (input_boundaries.size() > static_cast<std::size_t>(mnum) + 1);
+        split_queue_t splits(input_boundaries);
+        mr_run_pipeline<Item>(
+            mnum, rnum,
+            [&](int i, int out_id, thread_metrics_t *tm, container_info_t *out_info)
+            { thread_worker<M, C>(input_file_id, out_id,
+                                  dynamic_splits ? 0 : input_boundaries[i],
+                                  dynamic_splits ? no_pos : input_boundaries[i + 1],
+                                  sortf, nullptr, tm, dynamic_splits ? &splits : nullptr, out_info); },
+            type_name(typeid(M)),
+            [](int in_id, int out_id, thread_metrics_t *tm, container_info_t *out_info)
+            { thread_worker<R>(in_id, out_id, 0, no_pos, nullptr, nullptr, tm, nullptr, out_info); },
+            type_name(typeid(R)));
+    }
+};
+
+/**
+ * @brief Merges sorted runs as they get ready: while producers of runs
+ * are still running, every 'fanin' ready runs are merged into one on the pool,
+ * so only a few runs are left for the final merge
+ */
+template <typename Item>
+class run_merger_t
+{
+public:
+    run_merger_t(int _producers, int _fanin, stage_metrics_t &_stage)
+        : producers(_producers), fanin(std::max(2, _fanin)), stage(_stage)
+    {
+    }
+
+    // A producer has finished its run
+    void produced(const container_info_t &run)
+    {
+        std::lock_guard lock(mutex);
+        producers--;
+        push(run);
+    }
+
+    // Wait for merges in flight, return the runs left
+    std::vector<container_info_t> finish()
+    {
+        tasks.wait();
+        return ready;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<container_info_t> ready; // runs, which are not being merged
+    int producers;
+    int fanin;
+    stage_metrics_t &stage; // its counters are guarded by mutex
+    task_group_t tasks;
+
+    // Must be called under mutex
+    void push(const container_info_t &run)
+    {
+        ready.push_back(run);
+        if (producers == 0 || static_cast<int>(ready.size()) < fanin)
+            return;
+        std::vector<container_info_t> runs(ready.begin(), ready.begin() + fanin);
+        ready.erase(ready.begin(), ready.begin() + fanin);
+        tasks.run([this, runs = std::move(runs)]
+                  { merge(runs); });
+    }
+
+    void merge(const std::vector<container_info_t> &runs)
+    {
+        auto start = std::chrono::steady_clock::now();
+        container_info_t out_info{mr_manifest.reserve_ids(1)};
+        long bytes_read = 0;
+        {
+            std::vector<std::unique_ptr<std::istream>> files;
+            std::vector<std::istream *> inputs;
+            for (auto &r : runs)
+            {
+                bytes_read += r.bytes;
+                files.push_back(open_merge_input(workfile_path(r.id), merge_buffer_size(runs.size())));
+                inputs.push_back(files.back().get());
+            }
+            auto out = open_merge_output(workfile_path(out_info.id));
+            for (kway_merge_t<std::istream, Item> merge(inputs); !merge.empty(); merge.pop())
+            {
+                write_item(*out, merge.top());
+                out_info.records++;
+            }
+            for (std::size_t i = 0; i < runs.size(); ++i)
+                check_merge_input(*files[i], workfile_path(runs[i].id));
+            out_info.bytes = out->tellp();
+        }
+        for (auto &r : runs)
+            mr_delete_container_file(r.id);
+
+        std::lock_guard lock(mutex);
+        auto &counters = stage.counters;
+        counters["merges"]++;
+        counters["merge_runs"] += runs.size();
+        counters["merge_records"] += out_info.records;
+        counters["merge_bytes_read"] += bytes_read;
+        counters["merge_bytes_written"] += out_info.bytes;
+        counters["merge_us"] += std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+        push(out_info);
+    }
+};
+
+template <typename Item>
+void mr_run_pipeline(int mnum, int rnum,
+                     const map_task_t &map_task, const std::string &map_variant,
+                     const reduce_task_t &reduce_task, const std::string &reduce_variant)
+{
+    int map_base = mr_manifest.reserve_ids(mnum);
+    std::optional<stage_probe_t> shuffle_probe(std::in_place, "shuffle", 1, "pipelined");
+    run_merger_t<Item> merger(mnum, mr_config.pipeline_merge_fanin, shuffle_probe->stage());
+    {
+        stage_probe_t probe("map", mnum, map_variant);
+        task_group_t maps;
+        for (int i = 0; i < mnum; ++i)
+            maps.run([&, i]
+                     {
+                         container_info_t run;
+                         map_task(i, map_base + i, probe.thread(i), &run);
+                         merger.produced(run); });
+        maps.wait();
+    }
+    auto runs = merger.finish();
+    shuffle_probe->stage().counters["final_runs"] = runs.size();
+
+    // The final merge is cut into rnum containers, a reducer starts on a container
+    // as soon as it is closed, while the merge goes on
+    int containers_base = mr_manifest.reserve_ids(rnum);
+    std::vector<container_info_t> results(rnum);
+    stage_probe_t reduce_probe("reduce", rnum, reduce_variant);
+    task_group_t reduces;
+    {
+        auto tm = shuffle_probe->thread(0);
+        thread_probe_t tprobe(tm);
+        std::vector<std::unique_ptr<std::istream>> files;
+        std::vector<std::istream *> inputs;
+        long records = 0;
+        for (auto &r : runs)
+        {
+            tm->bytes_read += r.bytes;
+            records += r.records;
+            files.push_back(open_merge_input(workfile_path(r.id), merge_buffer_size(runs.size())));
+            inputs.push_back(files.back().get());
+        }
+
+        long out_container_size = i_ceiling(records, static_cast<long>(rnum));
+        // Balanced containers are cut at split keys of the sampled runs instead
+        using K = typename Item::key_type;
+        std::vector<K> splits;
+        if (mr_config.partition_mode == partition_mode_t::balanced)
+        {
+            std::vector<std::vector<sample_t<K>>> samples;
+            splits = sample_split_keys<Item>(runs, rnum, samples, shuffle_probe->stage());
+        }
+        std::size_t next_split = 0;
+        std::vector<long> partitions;
+        int part = 0;
+        long out_count = 0;
+        auto out = open_merge_output(workfile_path(containers_base));
+        auto close_part = [&]
+        {
+            tm->bytes_written += out->tellp();
+            partitions.push_back(out_count);
+            out.reset();
+            // The cut containers are not in the manifest, a reducer deletes its own as it is done
+            reduces.run([&, part]
+                        {
+                            reduce_task(containers_base + part, mr_manifest.reserve_ids(1),
+                                        reduce_probe.thread(part), &results[part]);
+                            mr_delete_container_file(containers_base + part); });
+            ++part;
+        };
+
+        typename Item::key_type prev_key{};
+        for (kway_merge_t<std::istream, Item> merge(inputs); !merge.empty(); merge.pop())
+        {
+            const auto &cur = merge.top();
+            // Equal keys never straddle two containers
+            int advance = 0;
+            if (mr_config.partition_mode == partition_mode_t::balanced)
+                for (; next_split < splits.size() && !(cur.key < splits[next_split]); ++next_split)
+                    ++advance;
+            else if (out_count >= out_container_size && cur.key != prev_key)
+                advance = 1;
+            for (; advance > 0 && part < rnum - 1; --advance)
+            {
+                close_part();
+                out = open_merge_output(workfile_path(containers_base + part));
+                out_count = 0;
+            }
+            write_item(*out, cur);
+            out_count++;
+            tm->records_in++;
+            prev_key = cur.key;
+        }
+        for (std::size_t i = 0; i < runs.size(); ++i)
+            check_merge_input(*files[i], workfile_path(runs[i].id));
+        close_part();
+        // Too few records for rnum containers: the rest of them are empty
+        while (part < rnum)
+        {
+            out = open_merge_output(workfile_path(containers_base + part));
+            out_count = 0;
+            close_part();
+        }
+        tm->records_out = tm->records_in;
+        report_partitions(partitions, shuffle_probe->stage());
+    }
+    for (auto &r : runs)
+        mr_delete_container_file(r.id);
+    shuffle_probe.reset();
+
+    reduces.wait();
+    mr_manifest.commit(std::move(results));
+}
+
+// The sample jobs' pipeline is built once, in the library
+extern template void mr_run_pipeline<citem_t>(int mnum, int rnum,
+                                              const map_task_t &map_task, const std::string &map_variant,
+                                              const reduce_task_t &reduce_task, const std::string &reduce_variant);
@@ -0,0 +1,156 @@
+/**
+ * @brief mr_pool.cpp
+ * realization of the thread pool
+ */
+#include "mr_pool.h"
+#include "mr_framework.h"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+// Index of the pool worker running the current thread, -1 if it is not a worker
+static thread_local int worker_self = -1;
+static thread_local thread_pool_t *worker_pool = nullptr;
+
+thread_pool_t::thread_pool_t(unsigned nthreads)
+{
+    nthreads = std::max(1u, nthreads);
+    for (unsigned i = 0; i < nthreads; ++i)
+        queues.push_back(std::make_unique<queue_t>());
+    for (unsigned i = 0; i < nthreads; ++i)
+        workers.emplace_back(&thread_pool_t::worker_loop, this, i);
+}
+
+thread_pool_t::~thread_pool_t()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto &w : workers)
+        w.join();
+}
+
+void thread_pool_t::submit(std::function<void()> task)
+{
+    unsigned i = (worker_pool == this) ? worker_self : next++ % queues.size();
+    {
+        std::lock_guard lock(queues[i]->mutex);
+        queues[i]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard lock(mutex);
+        queued++;
+    }
+    cv.notify_one();
+}
+
+bool thread_pool_t::pop(int self, std::function<void()> &task)
+{
+    if (self >= 0)
+    {
+        auto &q = *queues[self];
+        std::lock_guard lock(q.mutex);
+        if (q.tasks.size())
+        {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    std::size_t n = queues.size();
+    std::size_t base = (self >= 0) ? self + 1 : 0;
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        auto &q = *queues[(base + k) % n];
+        std::lock_guard lock(q.mutex);
+        if (q.tasks.size())
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool thread_pool_t::try_run_one()
+{
+    std::function<void()> task;
+    if (!pop(worker_pool == this ? worker_self : -1, task))
+        return false;
+    task();
+    return true;
+}
+
+void thread_pool_t::worker_loop(unsigned self)
+{
+    worker_self = self;
+    worker_pool = this;
+    std::function<void()> task;
+    while (true)
+    {
+        if (pop(self, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this]
+                { return stop || queued > 0; });
+        if (stop && queued == 0)
+            return;
+    }
+}
+
+thread_pool_t &mr_pool()
+{
+    static thread_pool_t pool(mr_config.threads ? mr_config.threads : std::thread::hardware_concurrency());
+    return pool;
+}
+
+void task_group_t::run(std::function<void()> task)
+{
+    pending++;
+    pool.submit([this, task = std::move(task)]
+                {
+                    try
+                    {
+                        task();
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lock(mutex);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                    std::lock_guard lock(mutex);
+                    if (--pending == 0)
+                        cv.notify_all(); });
+}
+
+void task_group_t::wait_noexcept()
+{
+    using namespace std::chrono_literals;
+    while (pending > 0)
+    {
+        if (pool.try_run_one())
+            continue;
+        std::unique_lock lock(mutex);
+        cv.wait_for(lock, 1ms, [this]
+                    { return pending == 0; });
+    }
+    // The last task may still hold the mutex to notify
+    std::lock_guard lock(mutex);
+}
+
+void task_group_t::wait()
+{
+    wait_noexcept();
+    if (error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+}
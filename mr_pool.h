@@ -0,0 +1,86 @@
+/**
+ * @brief mr_pool.h
+ * framework-wide thread pool with work-stealing deques,
+ * which runs tasks of all the stages
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Pool of worker threads, every worker has its own deque of tasks;
+ * a worker takes tasks from the back of its deque, an idle one steals
+ * from the front of the others
+ */
+class thread_pool_t
+{
+public:
+    explicit thread_pool_t(unsigned nthreads);
+    ~thread_pool_t();
+    thread_pool_t(const thread_pool_t &) = delete;
+    thread_pool_t &operator=(const thread_pool_t &) = delete;
+
+    // Queue a task: to the own deque, if called by a worker, else round robin
+    void submit(std::function<void()> task);
+
+    // Run one queued task on the calling thread; false if there was none
+    bool try_run_one();
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+private:
+    struct queue_t
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue_t>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<long> queued{0};
+    std::atomic<unsigned> next{0};
+    bool stop = false;
+
+    bool pop(int self, std::function<void()> &task);
+    void worker_loop(unsigned self);
+};
+
+// The framework-wide pool, sized by mr_config.threads on first use
+thread_pool_t &mr_pool();
+
+/**
+ * @brief A set of tasks run on a pool, which can be waited for together;
+ * a waiting thread runs queued tasks meanwhile, so waits may nest
+ */
+class task_group_t
+{
+public:
+    explicit task_group_t(thread_pool_t &_pool = mr_pool()) : pool(_pool) {}
+    ~task_group_t() { wait_noexcept(); }
+    task_group_t(const task_group_t &) = delete;
+    task_group_t &operator=(const task_group_t &) = delete;
+
+    void run(std::function<void()> task);
+
+    // Wait for all the tasks; rethrows the first exception of them
+    void wait();
+
+private:
+    thread_pool_t &pool;
+    std::atomic<long> pending{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+
+    void wait_noexcept();
+};
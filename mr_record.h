@@ -0,0 +1,321 @@
+/**
+ * @brief mr_record.h
+ * key/value records of containers and their binary and text forms
+ */
+#pragma once
+
+#include <array>
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief Container item - key+val
+ * @tparam K key type: std::string, an integral type, a fixed-size byte array
+ * or a trivially copyable struct, ordered by operator<
+ * @tparam V value type: any of those but ordering is not needed
+ */
+template <typename K, typename V>
+struct kv_item_t
+{
+    using key_type = K;
+    using value_type = V;
+    K key{};
+    V val{};
+
+    kv_item_t() = default;
+    kv_item_t(K _key, V _val) : key(std::move(_key)), val(std::move(_val)) {}
+    // A string key of another allocator, e.g. std::string for a citem_t
+    template <typename S>
+        requires(!std::same_as<S, K> && std::convertible_to<const S &, std::string_view> &&
+                 std::constructible_from<K, std::string_view>)
+    kv_item_t(const S &_key, V _val) : key(std::string_view(_key)), val(std::move(_val))
+    {
+    }
+};
+
+// Strings of any allocator are string keys
+template <typename K>
+concept string_key = std::same_as<K, std::basic_string<char, std::char_traits<char>, typename K::allocator_type>>;
+
+// The item of the sample jobs; its keys are strings of a polymorphic allocator,
+// so a worker can keep them in an arena, see mr_arena.h
+using citem_t = kv_item_t<std::pmr::string, int>;
+
+// Raw bytes go to and from the stream buffer directly, with no sentry per call
+inline void put_bytes(std::ostream &os, const char *p, std::size_t n)
+{
+    if (os.rdbuf()->sputn(p, n) != static_cast<std::streamsize>(n))
+        os.setstate(std::ios::badbit);
+}
+
+inline bool get_bytes(std::istream &is, char *p, std::size_t n)
+{
+    if (is.rdbuf()->sgetn(p, n) == static_cast<std::streamsize>(n))
+        return true;
+    is.setstate(std::ios::eofbit | std::ios::failbit);
+    return false;
+}
+
+// Varints: 7 bits per byte, the high bit marks a byte to follow
+inline void put_varint(std::ostream &os, unsigned long v)
+{
+    char buf[10];
+    int n = 0;
+    for (; v >= 0x80; v >>= 7)
+        buf[n++] = static_cast<char>(v | 0x80);
+    buf[n++] = static_cast<char>(v);
+    put_bytes(os, buf, n);
+}
+
+inline bool get_varint(std::istream &is, unsigned long &v)
+{
+    auto sb = is.rdbuf();
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        auto c = sb->sbumpc();
+        if (c == std::char_traits<char>::eof())
+        {
+            is.setstate(std::ios::eofbit | std::ios::failbit);
+            return false;
+        }
+        v |= static_cast<unsigned long>(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    is.setstate(std::ios::failbit);
+    return false;
+}
+
+/**
+ * @brief Serializer traits of key and value types: binary write/read and text print
+ */
+template <typename T>
+struct serializer_t;
+
+// Unsigned integers are varints
+template <std::unsigned_integral T>
+struct serializer_t<T>
+{
+    static void write(std::ostream &os, T v) { put_varint(os, v); }
+    static bool read(std::istream &is, T &v)
+    {
+        unsigned long u;
+        if (!get_varint(is, u))
+            return false;
+        v = static_cast<T>(u);
+        return true;
+    }
+    static void print(std::ostream &os, T v) { os << +v; }
+};
+
+// Signed integers are zigzag varints, small negatives are short too
+template <std::signed_integral T>
+struct serializer_t<T>
+{
+    static void write(std::ostream &os, T v)
+    {
+        auto u = static_cast<unsigned long>(static_cast<long>(v));
+        put_varint(os, (u << 1) ^ static_cast<unsigned long>(static_cast<long>(v) >> 63));
+    }
+    static bool read(std::istream &is, T &v)
+    {
+        unsigned long u;
+        if (!get_varint(is, u))
+            return false;
+        v = static_cast<T>((u >> 1) ^ -(u & 1));
+        return true;
+    }
+    static void print(std::ostream &os, T v) { os << +v; }
+};
+
+// Longest string of a container; a longer length read is taken for a broken container
+constexpr unsigned long max_string_size = 1UL << 26;
+
+// Strings are a varint length and the bytes
+template <string_key T>
+struct serializer_t<T>
+{
+    static void write(std::ostream &os, const T &v)
+    {
+        if (v.size() > max_string_size)
+        {
+            os.setstate(std::ios::badbit);
+            return;
+        }
+        put_varint(os, v.size());
+        put_bytes(os, v.data(), v.size());
+    }
+    static bool read(std::istream &is, T &v)
+    {
+        unsigned long len;
+        if (!get_varint(is, len))
+            return false;
+        if (len > max_string_size)
+        {
+            is.setstate(std::ios::failbit);
+            return false;
+        }
+        v.resize(len);
+        return get_bytes(is, v.data(), len);
+    }
+    static void print(std::ostream &os, const T &v) { os << v; }
+};
+
+template <typename T>
+struct is_byte_array : std::false_type
+{
+};
+template <std::size_t N>
+struct is_byte_array<std::array<char, N>> : std::true_type
+{
+};
+template <std::size_t N>
+struct is_byte_array<std::array<unsigned char, N>> : std::true_type
+{
+};
+
+// Fixed-size byte strings and other plain structs are their raw bytes
+template <typename T>
+    requires(std::is_trivially_copyable_v<T> && !std::integral<T>)
+struct serializer_t<T>
+{
+    static void write(std::ostream &os, const T &v)
+    {
+        put_bytes(os, reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+    static bool read(std::istream &is, T &v)
+    {
+        return get_bytes(is, reinterpret_cast<char *>(&v), sizeof(T));
+    }
+    static void print(std::ostream &os, const T &v)
+    {
+        if constexpr (requires { os << v; })
+            os << v;
+        else if constexpr (is_byte_array<T>::value)
+            os << std::string_view(reinterpret_cast<const char *>(v.data()), v.size());
+        else
+        {
+            static const char hex[] = "0123456789abcdef";
+            auto p = reinterpret_cast<const unsigned char *>(&v);
+            for (std::size_t i = 0; i < sizeof(T); ++i)
+                os << hex[p[i] >> 4] << hex[p[i] & 0xf];
+        }
+    }
+};
+
+// An empty key marks no item; keys of fixed size are never empty
+template <typename K>
+bool empty_key(const K &key)
+{
+    if constexpr (string_key<K>)
+        return key.empty();
+    else
+        return false;
+}
+
+// Three-way comparison of keys, by operator<=> if there is one
+template <typename K>
+int compare_keys(const K &a, const K &b)
+{
+    if constexpr (string_key<K>)
+        return a.compare(b);
+    else if constexpr (std::three_way_comparable<K>)
+    {
+        auto c = a <=> b;
+        return c < 0 ? -1 : c > 0 ? 1 : 0;
+    }
+    else
+        return a < b ? -1 : b < a ? 1 : 0;
+}
+
+// Hash of keys: std::hash, if there is one, or of the raw bytes
+template <typename K>
+std::size_t hash_key(const K &key)
+{
+    if constexpr (requires { std::hash<K>{}(key); })
+        return std::hash<K>{}(key);
+    else
+        return std::hash<std::string_view>{}(
+            std::string_view(reinterpret_cast<const char *>(&key), sizeof(K)));
+}
+
+// Item order by key, resolved at compile time
+struct key_less_t
+{
+    template <typename Item>
+    bool operator()(const Item &a, const Item &b) const
+    {
+        return a.key < b.key;
+    }
+};
+
+// Binary form of items in container files: the key, then the value
+template <typename K, typename V>
+void write_item(std::ostream &os, const kv_item_t<K, V> &it)
+{
+    try
+    {
+        serializer_t<K>::write(os, it.key);
+        serializer_t<V>::write(os, it.val);
+    }
+    catch (std::ios::failure &e)
+    {
+        std::cerr << e.what() << '\n';
+    }
+}
+
+template <typename K, typename V>
+std::ofstream &operator<<(std::ofstream &os, const kv_item_t<K, V> &it)
+{
+    write_item(os, it);
+    return os;
+}
+
+// Items are read in binary form from any stream, there is no text input of them
+template <typename K, typename V>
+std::istream &operator>>(std::istream &is, kv_item_t<K, V> &it)
+{
+    try
+    {
+        if (!serializer_t<K>::read(is, it.key))
+            return is;
+        if (!serializer_t<V>::read(is, it.val))
+            is.setstate(std::ios::failbit);
+    }
+    catch (std::ios::failure &e)
+    {
+        std::cerr << e.what() << '\n';
+    }
+    return is;
+}
+
+// Text form of an item, for the final result and dumps
+template <typename K, typename V>
+std::ostream &operator<<(std::ostream &os, const kv_item_t<K, V> &it)
+{
+    serializer_t<K>::print(os, it.key);
+    os << " ";
+    serializer_t<V>::print(os, it.val);
+    return os;
+}
+
+// Read next item of a container; false when the container is exhausted
+template <typename K, typename V>
+bool read_item(std::istream &is, kv_item_t<K, V> &it)
+{
+    while (is >> it)
+        if (!empty_key(it.key))
+            return true;
+    return false;
+}
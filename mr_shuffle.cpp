@@ -0,0 +1,9 @@
+/**
+ * @brief mr_shuffle.cpp
+ * realization of shuffle stage
+ * for map-reduce framework, based on files
+ */
+#include "mr_framework.h"
+
+template void mr_shuffle<citem_t>(int mnum, int rnum, shuffle_mode_t mode);
+template void mr_shuffle<citem_t>(int mnum, int rnum);
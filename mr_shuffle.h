@@ -0,0 +1,556 @@
+/**
+ * @brief mr_shuffle.h
+ * templates of shuffle stage
+ * for map-reduce framework, based on files; included by mr_framework.h
+ */
+#pragma once
+
+#include "mr_framework.h"
+#include "mr_merge.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Sampled record of a sorted container
+ */
+template <typename K>
+struct sample_t
+{
+    K key;
+    std::streamoff pos; // position of the record in its container
+};
+
+/**
+ * @brief Reader of the [lo, hi) key range of a sorted container
+ */
+template <typename K>
+struct range_reader_t
+{
+    std::unique_ptr<std::istream> in;
+    std::streamoff start = 0;
+    const K *lo = nullptr; // nullptr - unbounded
+    const K *hi = nullptr;
+};
+
+template <typename Item>
+bool read_item(range_reader_t<typename Item::key_type> &r, Item &it)
+{
+    while (read_item(*r.in, it))
+    {
+        if (r.hi && it.key >= *r.hi)
+            return false;
+        if (!r.lo || it.key >= *r.lo)
+        {
+            r.lo = nullptr; // further keys are sorted
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Read every 'step'-th record of a sorted container with its position
+ */
+template <typename Item>
+std::vector<sample_t<typename Item::key_type>> sample_container(int container_id, long step)
+{
+    std::vector<sample_t<typename Item::key_type>> samples;
+    container_ifstream_t in(workfile_path(container_id));
+    Item it;
+    for (long n = 0; true; ++n)
+    {
+        std::streamoff pos = (n % step == 0) ? static_cast<std::streamoff>(in.tellg()) : 0;
+        if (!read_item(in, it))
+            break;
+        if (n % step == 0)
+            samples.push_back({it.key, pos});
+    }
+    return samples;
+}
+
+/**
+ * @brief Pick up to rnum - 1 strictly increasing split keys at sample quantiles
+ */
+template <typename K>
+std::vector<K> choose_split_keys(const std::vector<std::vector<sample_t<K>>> &samples, int rnum)
+{
+    std::vector<K> keys;
+    for (auto &s : samples)
+        for (auto &smp : s)
+            keys.push_back(smp.key);
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<K> splits;
+    for (int i = 1; i < rnum && keys.size(); ++i)
+    {
+        auto &key = keys[keys.size() * i / rnum];
+        if (splits.empty() || splits.back() < key)
+            splits.push_back(key);
+    }
+    return splits;
+}
+
+/**
+ * @brief Estimated distribution of keys: the distinct sampled keys in order
+ * and the records of the inputs from every key up to the next one
+ */
+template <typename K>
+struct key_histogram_t
+{
+    std::vector<K> keys;
+    std::vector<long> records;
+    long total = 0;
+};
+
+/**
+ * @brief Histogram of the samples of the containers: a sample stands for
+ * the records from it up to the next sample of its container
+ */
+template <typename K>
+key_histogram_t<K> key_histogram(const std::vector<container_info_t> &containers,
+                                 const std::vector<std::vector<sample_t<K>>> &samples, long step)
+{
+    std::vector<std::pair<const K *, long>> weighted;
+    for (std::size_t i = 0; i < samples.size(); ++i)
+        for (std::size_t j = 0; j < samples[i].size(); ++j)
+        {
+            long first = static_cast<long>(j) * step;
+            long records = containers[i].records > first ? std::min(step, containers[i].records - first) : step;
+            weighted.push_back({&samples[i][j].key, records});
+        }
+    std::sort(weighted.begin(), weighted.end(), [](const auto &a, const auto &b)
+              { return *a.first < *b.first; });
+
+    key_histogram_t<K> h;
+    for (auto &[key, records] : weighted)
+    {
+        if (h.keys.empty() || h.keys.back() < *key)
+        {
+            h.keys.push_back(*key);
+            h.records.push_back(0);
+        }
+        h.records.back() += records;
+        h.total += records;
+    }
+    return h;
+}
+
+/**
+ * @brief Pick up to rnum - 1 split keys, which minimise the largest estimated partition:
+ * the least cap of records, which rnum partitions of whole keys fit in, is found by binary search,
+ * then the keys are cut greedily by it; when there are no more keys left than partitions,
+ * every key gets a partition of its own, so no partition is left empty needlessly
+ */
+template <typename K>
+std::vector<K> balance_split_keys(const key_histogram_t<K> &h, int rnum)
+{
+    std::size_t n = h.keys.size();
+    if (!n || rnum < 2)
+        return {};
+    auto partitions = [&](long cap)
+    {
+        int parts = 1;
+        long size = 0;
+        for (long records : h.records)
+        {
+            if (size && size + records > cap)
+            {
+                ++parts;
+                size = 0;
+            }
+            size += records;
+        }
+        return parts;
+    };
+    long lo = *std::max_element(h.records.begin(), h.records.end()), hi = h.total;
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+        if (partitions(mid) <= rnum)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    std::vector<K> splits;
+    int parts = 1;
+    long size = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (i && (size + h.records[i] > lo || n - i <= static_cast<std::size_t>(rnum - parts)))
+        {
+            splits.push_back(h.keys[i]);
+            ++parts;
+            size = 0;
+        }
+        size += h.records[i];
+    }
+    return splits;
+}
+
+/**
+ * @brief Add the estimated partitions of the split keys and the heavy hitters to the stage:
+ * keys, whose records are estimated to exceed a fair share of a partition, total / rnum
+ */
+template <typename K>
+void report_split_keys(const key_histogram_t<K> &h, const std::vector<K> &splits, int rnum, stage_metrics_t &stage)
+{
+    constexpr std::size_t max_heavy_hitters = 16;
+    long fair_share = h.total / std::max(rnum, 1);
+    long max_partition = 0, partition = 0;
+    std::size_t k = 0;
+    std::vector<std::size_t> heavy;
+    for (std::size_t i = 0; i < h.keys.size(); ++i)
+    {
+        if (k < splits.size() && !(h.keys[i] < splits[k]))
+        {
+            max_partition = std::max(max_partition, partition);
+            partition = 0;
+            ++k;
+        }
+        partition += h.records[i];
+        if (rnum > 1 && h.records[i] > fair_share)
+            heavy.push_back(i);
+    }
+    max_partition = std::max(max_partition, partition);
+    std::sort(heavy.begin(), heavy.end(), [&](std::size_t a, std::size_t b)
+              { return h.records[a] > h.records[b]; });
+
+    auto &c = stage.counters;
+    c["sampled_keys"] = h.keys.size();
+    c["partition_est_max_records"] = max_partition;
+    c["heavy_hitters"] = heavy.size();
+    for (std::size_t i = 0; i < std::min(heavy.size(), max_heavy_hitters); ++i)
+    {
+        std::ostringstream key;
+        serializer_t<K>::print(key, h.keys[heavy[i]]);
+        stage.heavy_hitters.push_back({key.str(), h.records[heavy[i]]});
+    }
+}
+
+/**
+ * @brief Sample sorted containers and pick split keys of rnum partitions of them
+ * by mr_config.partition_mode; the samples are kept for range starts
+ */
+template <typename Item, typename K = typename Item::key_type>
+std::vector<K> sample_split_keys(const std::vector<container_info_t> &containers, int rnum,
+                                 std::vector<std::vector<sample_t<K>>> &samples, stage_metrics_t &stage)
+{
+    long records = 0;
+    for (auto &c : containers)
+        records += c.records;
+    long step = std::max(1L, records / (rnum * mr_config.shuffle_samples_per_range));
+    samples.assign(containers.size(), {});
+    {
+        auto start = std::chrono::steady_clock::now();
+        task_group_t tasks;
+        for (std::size_t i = 0; i < containers.size(); ++i)
+            tasks.run([&samples, &containers, i, step]
+                      { samples[i] = sample_container<Item>(containers[i].id, step); });
+        tasks.wait();
+        auto &counters = stage.counters;
+        counters["sample_us"] = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+        for (auto &c : containers)
+            counters["sample_bytes"] += c.bytes;
+    }
+
+    auto h = key_histogram(containers, samples, step);
+    auto splits = (mr_config.partition_mode == partition_mode_t::balanced) ? balance_split_keys(h, rnum)
+                                                                            : choose_split_keys(samples, rnum);
+    report_split_keys(h, splits, rnum, stage);
+    return splits;
+}
+
+/**
+ * @brief Add the sizes of the partitions, as a shuffle has cut them, to the stage
+ */
+inline void report_partitions(const std::vector<long> &records, stage_metrics_t &stage)
+{
+    auto &c = stage.counters;
+    c["partition_max_records"] = records.empty() ? 0 : *std::max_element(records.begin(), records.end());
+    c["empty_partitions"] = std::count(records.begin(), records.end(), 0L);
+}
+
+/**
+ * @brief Position in a sorted container to start reading keys >= lo from
+ */
+template <typename K>
+std::streamoff range_start(const std::vector<sample_t<K>> &samples, const K &lo)
+{
+    auto it = std::lower_bound(samples.begin(), samples.end(), lo,
+                               [](const sample_t<K> &s, const K &k)
+                               { return s.key < k; });
+    return it == samples.begin() ? 0 : std::prev(it)->pos;
+}
+
+/**
+ * @brief Merge [lo, hi) key range of all inputs into one output container
+ */
+template <typename Item, typename K = typename Item::key_type>
+void shuffle_range_worker(const std::vector<container_info_t> &containers, container_info_t &out_info,
+                          const K *lo, const K *hi,
+                          const std::vector<std::vector<sample_t<K>>> &samples,
+                          thread_metrics_t *tm)
+{
+    thread_probe_t probe(tm);
+    std::list<range_reader_t<K>> readers;
+    std::vector<range_reader_t<K> *> inputs;
+    for (std::size_t i = 0; i < containers.size(); ++i)
+    {
+        auto &r = readers.emplace_back();
+        if (lo)
+            r.start = range_start(samples[i], *lo);
+        r.in = open_merge_input(workfile_path(containers[i].id), merge_buffer_size(containers.size()), r.start);
+        r.lo = lo;
+        r.hi = hi;
+        inputs.push_back(&r);
+    }
+
+    auto out = open_merge_output(workfile_path(out_info.id));
+    for (kway_merge_t<range_reader_t<K>, Item> merge(inputs); !merge.empty(); merge.pop())
+    {
+        write_item(*out, merge.top());
+        tm->records_in++;
+    }
+    tm->records_out = tm->records_in;
+    tm->bytes_written = out->tellp();
+    out_info.records = tm->records_out;
+    out_info.bytes = tm->bytes_written;
+
+    std::size_t i = 0;
+    for (auto &r : readers)
+        check_merge_input(*r.in, workfile_path(containers[i++].id));
+    i = 0;
+    for (auto &r : readers)
+    {
+        // Positions of compressed containers are virtual, bytes read are told by file offsets
+        std::streamoff end = r.in->fail() ? containers[i].bytes
+                                          : container_file_offset(*r.in, static_cast<std::streamoff>(r.in->tellg()));
+        tm->bytes_read += end - container_file_offset(*r.in, r.start);
+        ++i;
+    }
+}
+
+/**
+ * @brief Shuffle with rnum threads, every thread merges its key range of all inputs
+ * @param containers inputs, the containers of the previous stage
+ * @param outputs rnum output containers
+ */
+template <typename Item>
+void shuffle_parallel(const std::vector<container_info_t> &containers,
+                      std::vector<container_info_t> &outputs, stage_probe_t &probe)
+{
+    using K = typename Item::key_type;
+    int rnum = static_cast<int>(outputs.size());
+    std::vector<std::vector<sample_t<K>>> samples;
+
+    // Equal keys never straddle two outputs, as ranges are bounded by keys
+    auto splits = sample_split_keys<Item>(containers, rnum, samples, probe.stage());
+    int nranges = static_cast<int>(splits.size()) + 1;
+    task_group_t tasks;
+    for (int i = 0; i < nranges; ++i)
+    {
+        auto lo = (i > 0) ? &splits[i - 1] : nullptr;
+        auto hi = (i < nranges - 1) ? &splits[i] : nullptr;
+        tasks.run([=, &containers, &outputs, &samples, &probe]
+                  { shuffle_range_worker<Item>(containers, outputs[i], lo, hi, samples, probe.thread(i)); });
+    }
+    // Too few distinct keys for rnum ranges: the rest of outputs are empty
+    for (int i = nranges; i < rnum; ++i)
+        container_ofstream_t(workfile_path(outputs[i].id));
+    tasks.wait();
+}
+
+/**
+ * @brief Shuffle as a single global merge, cut into equal-sized output containers
+ * @param containers inputs, the containers of the previous stage
+ * @param outputs rnum output containers
+ */
+template <typename Item>
+void shuffle_sequential(const std::vector<container_info_t> &containers,
+                        std::vector<container_info_t> &outputs, stage_probe_t &probe)
+{
+    auto tm = probe.thread(0);
+    thread_probe_t tprobe(tm);
+    std::vector<std::unique_ptr<std::istream>> inp_containers;
+    for (auto &c : containers)
+        inp_containers.push_back(open_merge_input(workfile_path(c.id), merge_buffer_size(containers.size())));
+    std::vector<std::unique_ptr<std::ostream>> out_containers;
+    for (auto &o : outputs)
+        out_containers.push_back(open_merge_output(workfile_path(o.id)));
+
+    long int out_container_size = i_ceiling(mr_manifest.records(), static_cast<long>(outputs.size()));
+    // Balanced outputs are cut at split keys of the sampled inputs instead
+    using K = typename Item::key_type;
+    std::vector<K> splits;
+    if (mr_config.partition_mode == partition_mode_t::balanced)
+    {
+        std::vector<std::vector<sample_t<K>>> samples;
+        splits = sample_split_keys<Item>(containers, static_cast<int>(outputs.size()), samples, probe.stage());
+    }
+    std::size_t next_split = 0;
+
+    std::vector<std::istream *> inputs;
+    for (auto &c : inp_containers)
+        inputs.push_back(c.get());
+    kway_merge_t<std::istream, Item> merge(inputs);
+
+    // Fill up output containers
+    auto out_it = out_containers.begin();
+    auto out_info = outputs.begin();
+    typename Item::key_type prev_key{};
+    long out_count = 0;
+    while (!merge.empty())
+    {
+        const auto &cur = merge.top();
+
+        // Balanced outputs: pass to the output of the last split key, which the current key is at or past;
+        // otherwise, if current output container is filled up and the current item
+        // is not equal to the previously output item, pass to the next output container
+        int advance = 0;
+        if (mr_config.partition_mode == partition_mode_t::balanced)
+            for (; next_split < splits.size() && !(cur.key < splits[next_split]); ++next_split)
+                ++advance;
+        else if (out_count >= out_container_size && cur.key != prev_key)
+            advance = 1;
+        for (; advance > 0 && std::next(out_it) != out_containers.end(); --advance)
+        {
+            out_count = 0;
+            ++out_it;
+            ++out_info;
+        }
+
+        // Output current item and replenish the merge from its container
+        write_item(**out_it, cur);
+        out_count++;
+        out_info->records++;
+        tm->records_in++;
+        prev_key = cur.key;
+        merge.pop();
+    }
+    for (std::size_t i = 0; i < containers.size(); ++i)
+        check_merge_input(*inp_containers[i], workfile_path(containers[i].id));
+
+    tm->records_out = tm->records_in;
+    out_info = outputs.begin();
+    for (auto &c : out_containers)
+    {
+        (out_info++)->bytes = c->tellp();
+        tm->bytes_written += c->tellp();
+    }
+    for (auto &c : containers)
+        tm->bytes_read += c.bytes;
+}
+
+/**
+ * @brief Merge one partition's fragments of all map outputs into one output container
+ */
+template <typename Item>
+void shuffle_fragments_worker(const std::vector<container_info_t> &containers, int nparts, int part,
+                              container_info_t &out_info, thread_metrics_t *tm)
+{
+    thread_probe_t probe(tm);
+    std::vector<std::unique_ptr<std::istream>> fragments;
+    std::vector<std::istream *> inputs;
+    std::vector<std::string> paths;
+    std::size_t nfragments = (containers.size() - part + nparts - 1) / nparts;
+    for (std::size_t i = part; i < containers.size(); i += nparts)
+    {
+        tm->bytes_read += containers[i].bytes;
+        paths.push_back(workfile_path(containers[i].id));
+        fragments.push_back(open_merge_input(paths.back(), merge_buffer_size(nfragments)));
+        inputs.push_back(fragments.back().get());
+    }
+
+    auto out = open_merge_output(workfile_path(out_info.id));
+    for (kway_merge_t<std::istream, Item> merge(inputs); !merge.empty(); merge.pop())
+    {
+        write_item(*out, merge.top());
+        tm->records_in++;
+    }
+    for (std::size_t i = 0; i < fragments.size(); ++i)
+        check_merge_input(*fragments[i], paths[i]);
+    tm->records_out = tm->records_in;
+    tm->bytes_written = out->tellp();
+    out_info.records = tm->records_out;
+    out_info.bytes = tm->bytes_written;
+}
+
+/**
+ * @brief Shuffle of partitioned map outputs, every reducer's container
+ * is merged from its mnum fragments on its own thread; no global merge is needed
+ * @param containers inputs, fragments of the map outputs
+ * @param outputs a container per partition
+ */
+template <typename Item>
+void shuffle_fragments(const std::vector<container_info_t> &containers,
+                       std::vector<container_info_t> &outputs, stage_probe_t &probe)
+{
+    int rnum = static_cast<int>(outputs.size());
+    task_group_t tasks;
+    for (int p = 0; p < rnum; ++p)
+        tasks.run([=, &containers, &outputs, &probe]
+                  { shuffle_fragments_worker<Item>(containers, rnum, p, outputs[p], probe.thread(p)); });
+    tasks.wait();
+}
+
+/**
+ * @brief Realization of shuffle functionnality, takes the containers from mr_manifest
+ * and commits the outputs there
+ * @param mnum previuos stage number of files
+ * @param rnum needed next stage number of files
+ * @param mode realization to use
+ */
+template <typename Item>
+void mr_shuffle([[maybe_unused]] int mnum, int rnum, shuffle_mode_t mode)
+{
+    auto &containers = mr_manifest.containers;
+    int parts = mr_manifest.parts;
+    assert(containers.size() == static_cast<std::size_t>(mnum * std::max(parts, 1)));
+    std::vector<container_info_t> outputs(rnum);
+    int out_base = mr_manifest.reserve_ids(rnum);
+    for (int i = 0; i < rnum; ++i)
+        outputs[i].id = out_base + i;
+
+    // Map outputs are already partitioned, merge fragments whatever the mode is
+    bool parallel = parts || mode == shuffle_mode_t::parallel;
+    {
+        stage_probe_t probe("shuffle", parallel ? rnum : 1,
+                            parts ? "fragments" : parallel ? "parallel" : "sequential");
+        if (parts)
+        {
+            assert(parts == rnum);
+            shuffle_fragments<Item>(containers, outputs, probe);
+        }
+        else if (parallel)
+            shuffle_parallel<Item>(containers, outputs, probe);
+        else
+            shuffle_sequential<Item>(containers, outputs, probe);
+
+        std::vector<long> partitions;
+        for (auto &o : outputs)
+            partitions.push_back(o.records);
+        report_partitions(partitions, probe.stage());
+    }
+
+    mr_manifest.commit(std::move(outputs));
+}
+
+template <typename Item>
+void mr_shuffle(int mnum, int rnum)
+{
+    mr_shuffle<Item>(mnum, rnum, mr_config.shuffle_mode);
+}
+
+// The sample jobs' shuffle is built once, in the library
+extern template void mr_shuffle<citem_t>(int mnum, int rnum, shuffle_mode_t mode);
+extern template void mr_shuffle<citem_t>(int mnum, int rnum);
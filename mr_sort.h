@@ -0,0 +1,187 @@
+/**
+ * @brief mr_sort.h
+ * sorting of item buffers by normalized key prefixes and in parallel
+ */
+#pragma once
+
+#include "mr_pool.h"
+#include "mr_record.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief The first 8 bytes of a key as a big-endian integer, zero padded;
+ * prefixes order as the keys do, equal prefixes need the full keys to order
+ */
+inline std::uint64_t key_prefix(std::string_view key)
+{
+    std::uint64_t p = 0;
+    std::size_t n = std::min<std::size_t>(key.size(), 8);
+    for (std::size_t i = 0; i < n; ++i)
+        p |= static_cast<std::uint64_t>(static_cast<unsigned char>(key[i])) << (56 - 8 * i);
+    return p;
+}
+
+/**
+ * @brief Sort items by key through an array of (prefix, index) entries:
+ * the entries are radix sorted by prefix, which is held inline, so only ties
+ * of prefixes compare the full keys; then items are moved into their places
+ * @tparam Item record type with string key
+ */
+template <typename Item>
+void prefix_sort(std::vector<Item> &items)
+{
+    struct entry_t
+    {
+        std::uint64_t prefix;
+        std::uint32_t index;
+    };
+
+    // Small buffers and those, which an index does not fit, sort by comparison
+    constexpr std::size_t min_size = 64;
+    if (items.size() < min_size || items.size() > std::numeric_limits<std::uint32_t>::max())
+    {
+        std::sort(items.begin(), items.end(), key_less_t{});
+        return;
+    }
+
+    std::size_t n = items.size();
+    std::vector<entry_t> entries(n), temp(n);
+    for (std::size_t i = 0; i < n; ++i)
+        entries[i] = entry_t{key_prefix(items[i].key), static_cast<std::uint32_t>(i)};
+
+    // LSD radix sort by prefix bytes; a pass over a byte, which all prefixes share, is skipped
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        std::size_t count[256] = {};
+        for (auto &e : entries)
+            count[(e.prefix >> shift) & 0xff]++;
+        if (count[(entries[0].prefix >> shift) & 0xff] == n)
+            continue;
+        std::size_t pos = 0;
+        for (auto &c : count)
+            pos += std::exchange(c, pos);
+        for (auto &e : entries)
+            temp[count[(e.prefix >> shift) & 0xff]++] = e;
+        entries.swap(temp);
+    }
+
+    // Runs of equal prefixes are ordered by full keys
+    for (std::size_t begin = 0; begin < n;)
+    {
+        std::size_t end = begin + 1;
+        while (end < n && entries[end].prefix == entries[begin].prefix)
+            ++end;
+        if (end - begin > 1)
+            std::sort(entries.begin() + begin, entries.begin() + end,
+                      [&items](const entry_t &a, const entry_t &b)
+                      { return items[a.index].key < items[b.index].key; });
+        begin = end;
+    }
+
+    std::vector<Item> sorted;
+    sorted.reserve(n);
+    for (auto &e : entries)
+        sorted.push_back(std::move(items[e.index]));
+    items.swap(sorted);
+}
+
+/**
+ * @brief Sample sort on the thread pool: splitters are picked from a random sample,
+ * the items are scattered into nbuckets buckets of key ranges by slices in parallel,
+ * then every bucket is sorted by sort_bucket and moved back in place on its own task
+ * @tparam Item record type
+ * @tparam BucketSortF callable as sort_bucket(std::vector<Item> &)
+ */
+template <typename Item, typename BucketSortF>
+void sample_sort(std::vector<Item> &items, std::size_t nbuckets, BucketSortF &&sort_bucket)
+{
+    constexpr std::size_t oversampling = 32;
+    std::size_t n = items.size();
+    nbuckets = std::min(nbuckets, n / oversampling);
+    if (nbuckets < 2)
+    {
+        sort_bucket(items);
+        return;
+    }
+
+    // Splitters: every oversampling-th key of a sorted sample; equal keys all go to one bucket
+    std::vector<typename Item::key_type> sample;
+    {
+        std::mt19937_64 gen(n);
+        std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+        for (std::size_t i = 0; i < nbuckets * oversampling; ++i)
+            sample.push_back(items[pick(gen)].key);
+        std::sort(sample.begin(), sample.end());
+    }
+    std::vector<typename Item::key_type> splitters;
+    for (std::size_t b = 1; b < nbuckets; ++b)
+        splitters.push_back(std::move(sample[b * oversampling]));
+    splitters.erase(std::unique(splitters.begin(), splitters.end(),
+                                [](const auto &a, const auto &b)
+                                { return !(a < b) && !(b < a); }),
+                    splitters.end());
+    nbuckets = splitters.size() + 1;
+
+    // Every slice of items counts its items per bucket, then puts their indices to the buckets'
+    // places, which follow from the counts of the preceding slices
+    std::size_t nslices = nbuckets;
+    std::vector<std::uint32_t> bucket_of(n);
+    std::vector<std::size_t> counts(nslices * nbuckets);
+    auto slice_begin = [&](std::size_t s)
+    { return n * s / nslices; };
+    task_group_t tasks;
+    for (std::size_t s = 0; s < nslices; ++s)
+        tasks.run([&, s]
+                  {
+                      for (std::size_t i = slice_begin(s); i < slice_begin(s + 1); ++i)
+                      {
+                          auto b = std::upper_bound(splitters.begin(), splitters.end(), items[i].key) - splitters.begin();
+                          bucket_of[i] = static_cast<std::uint32_t>(b);
+                          counts[s * nbuckets + b]++;
+                      } });
+    tasks.wait();
+
+    std::vector<std::size_t> offsets(nslices * nbuckets), bucket_base(nbuckets + 1);
+    for (std::size_t b = 0; b < nbuckets; ++b)
+    {
+        std::size_t size = 0;
+        for (std::size_t s = 0; s < nslices; ++s)
+            offsets[s * nbuckets + b] = bucket_base[b] + std::exchange(size, size + counts[s * nbuckets + b]);
+        bucket_base[b + 1] = bucket_base[b] + size;
+    }
+    std::vector<std::size_t> order(n);
+    for (std::size_t s = 0; s < nslices; ++s)
+        tasks.run([&, s]
+                  {
+                      auto pos = offsets.begin() + s * nbuckets;
+                      for (std::size_t i = slice_begin(s); i < slice_begin(s + 1); ++i)
+                          order[pos[bucket_of[i]]++] = i; });
+    tasks.wait();
+
+    // Buckets are move-constructed from the items, so keys keep their allocators,
+    // e.g. arenas, and move back into the items' places, once all of them are taken
+    std::vector<std::vector<Item>> buckets(nbuckets);
+    for (std::size_t b = 0; b < nbuckets; ++b)
+        tasks.run([&, b]
+                  {
+                      buckets[b].reserve(bucket_base[b + 1] - bucket_base[b]);
+                      for (std::size_t j = bucket_base[b]; j < bucket_base[b + 1]; ++j)
+                          buckets[b].push_back(std::move(items[order[j]])); });
+    tasks.wait();
+
+    for (std::size_t b = 0; b < nbuckets; ++b)
+        tasks.run([&, b]
+                  {
+                      sort_bucket(buckets[b]);
+                      std::move(buckets[b].begin(), buckets[b].end(), items.begin() + bucket_base[b]);
+                      std::vector<Item>().swap(buckets[b]); });
+    tasks.wait();
+}